@@ -0,0 +1,169 @@
+// Times every phase of a render on one script and prints one JSON object per
+// phase, so runs can be compared by a script.
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/lexer.h"
+#include "../src/parser.h"
+#include "../src/audio.h"
+#include "../src/render.h"
+
+#define BENCH_RUNS 5
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Starts a new phase for peakrss_kb(). Writing 5 to clear_refs resets the
+// high water mark to the current RSS, where the kernel doesn't allow it the
+// peak just keeps growing over the whole run.
+static void resetpeak(void) {
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f == NULL) return;
+    fputs("5", f);
+    fclose(f);
+}
+
+// Peak RSS since the last resetpeak(), -1 when /proc isn't there
+static long peakrss_kb(void) {
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f == NULL) return -1;
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+static void report(const char *phase, double best, const char *unit, double amount) {
+    printf("{\"phase\": \"%s\", \"runs\": %d, \"best_s\": %.6f, \"%s\": %.0f, \"%s_per_s\": %.0f, \"peak_rss_kb\": %ld}\n",
+           phase, BENCH_RUNS, best, unit, amount, unit, best > 0 ? amount / best : 0, peakrss_kb());
+    fflush(stdout);
+}
+
+static size_t lexfile(const char *filepath) {
+    Arena arena = {0};
+    Buffer buf = {0};
+    Lexer l = lex_init(filepath, &buf, &arena);
+    size_t tokens = 0;
+    Token t;
+    do {
+        t = lex_next(&l);
+        tokens++;
+    } while (t.type != TT_EOF);
+    lex_close(&l);
+    arena_free(&arena);
+    return tokens;
+}
+
+// A regular file, so the mix goes through the same WAV output a normal render uses
+static char *tempoutput(void) {
+    static char path[] = "/tmp/trang-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Error while creating a temporary file: %s\n", strerror(errno));
+        exit(1);
+    }
+    close(fd);
+    return path;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-j N] [-o output] <file.trang>\n", program);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *filepath = NULL;
+    const char *output = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            renderopts.jobs = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else if (filepath == NULL) {
+            filepath = argv[i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (filepath == NULL) usage(argv[0]);
+    char *temp = output == NULL ? tempoutput() : NULL;
+    output = output != NULL ? output : temp;
+    double best, t;
+
+    size_t tokens = 0;
+    resetpeak();
+    best = 1e30;
+    for (int i = 0; i < BENCH_RUNS; ++i) {
+        t = now();
+        tokens = lexfile(filepath);
+        t = now() - t;
+        best = t < best ? t : best;
+    }
+    report("lex", best, "tokens", tokens);
+
+    resetpeak();
+    best = 1e30;
+    for (int i = 0; i < BENCH_RUNS; ++i) {
+        resetproject();
+        t = now();
+        if (!parse(filepath)) {
+            exit(1);
+        }
+        t = now() - t;
+        best = t < best ? t : best;
+    }
+    report("parse", best, "tokens", tokens);
+
+    // Decoding only happens once, later loads would hit the decoded sample store
+    RenderPlan plan;
+    resetpeak();
+    t = now();
+    if (!loadsamples()) {
+        exit(1);
+    }
+    t = now() - t;
+    buildplan(&plan);
+    printf("{\"phase\": \"load\", \"runs\": 1, \"best_s\": %.6f, \"samples\": %zu, \"peak_rss_kb\": %ld}\n",
+           t, plan.nsamples, peakrss_kb());
+    freeplan(&plan);
+
+    size_t events = 0;
+    resetpeak();
+    best = 1e30;
+    for (int i = 0; i < BENCH_RUNS; ++i) {
+        t = now();
+        buildplan(&plan);
+        t = now() - t;
+        best = t < best ? t : best;
+        events = plan.events.count;
+        freeplan(&plan);
+    }
+    report("plan", best, "events", events);
+
+    // saveaudio() counts floats, a frame is a stereo pair
+    size_t frames = 0;
+    resetpeak();
+    best = 1e30;
+    for (int i = 0; i < BENCH_RUNS; ++i) {
+        buildplan(&plan);
+        t = now();
+        frames = saveaudio(&plan, output) / 2;
+        t = now() - t;
+        best = t < best ? t : best;
+        freeplan(&plan);
+    }
+    report("mix", best, "frames", frames);
+    if (temp != NULL) {
+        unlink(temp);
+    }
+    return 0;
+}
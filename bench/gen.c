@@ -0,0 +1,129 @@
+// Generates a synthetic .trang workload for the benchmarks: a set of test WAVs
+// and a script that plays them.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/stat.h>
+
+typedef struct {
+    const char *dir;
+    size_t samples;
+    size_t patterns;
+    size_t rows;
+    float density;
+    size_t bpmchanges;
+    size_t sequence;
+    size_t samplelen;
+    unsigned seed;
+} GenOptions;
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s -o <dir> [-samples N] [-patterns M] [-rows R] [-density 0..1]\n"
+                    "          [-bpm-changes B] [-sequence L] [-sample-frames F] [-seed S]\n", program);
+    exit(1);
+}
+
+static void put16(FILE *f, uint16_t v) { fputc(v & 0xFF, f); fputc(v >> 8, f); }
+static void put32(FILE *f, uint32_t v) { put16(f, v); put16(f, v >> 16); }
+
+// Stereo 16 bit 44.1kHz decaying sine, different pitch for every sample
+static void writewav(const char *path, size_t frames, float freq) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Error while opening the file %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    uint32_t datasz = frames * 2 * 2;
+    fwrite("RIFF", 1, 4, f);
+    put32(f, 36 + datasz);
+    fwrite("WAVEfmt ", 1, 8, f);
+    put32(f, 16);
+    put16(f, 1);
+    put16(f, 2);
+    put32(f, 44100);
+    put32(f, 44100 * 4);
+    put16(f, 4);
+    put16(f, 16);
+    fwrite("data", 1, 4, f);
+    put32(f, datasz);
+    for (size_t i = 0; i < frames; ++i) {
+        float env = expf(-(float)i / (frames / 4.0f + 1));
+        int16_t v = sinf(2 * M_PI * freq * i / 44100) * env * 12000;
+        put16(f, v);
+        put16(f, v);
+    }
+    fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+    GenOptions o = {
+        .samples = 16, .patterns = 8, .rows = 64, .density = 0.25f,
+        .bpmchanges = 1, .sequence = 64, .samplelen = 11025, .seed = 1,
+    };
+    for (int i = 1; i < argc; ++i) {
+        if (i + 1 >= argc) usage(argv[0]);
+        const char *opt = argv[i], *val = argv[++i];
+        if (!strcmp(opt, "-o")) o.dir = val;
+        else if (!strcmp(opt, "-samples")) o.samples = strtoul(val, NULL, 10);
+        else if (!strcmp(opt, "-patterns")) o.patterns = strtoul(val, NULL, 10);
+        else if (!strcmp(opt, "-rows")) o.rows = strtoul(val, NULL, 10);
+        else if (!strcmp(opt, "-density")) o.density = strtof(val, NULL);
+        else if (!strcmp(opt, "-bpm-changes")) o.bpmchanges = strtoul(val, NULL, 10);
+        else if (!strcmp(opt, "-sequence")) o.sequence = strtoul(val, NULL, 10);
+        else if (!strcmp(opt, "-sample-frames")) o.samplelen = strtoul(val, NULL, 10);
+        else if (!strcmp(opt, "-seed")) o.seed = strtoul(val, NULL, 10);
+        else usage(argv[0]);
+    }
+    if (o.dir == NULL || o.samples == 0 || o.patterns == 0) usage(argv[0]);
+    srand(o.seed);
+    mkdir(o.dir, 0755);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/song.trang", o.dir);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error while opening the file %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    for (size_t i = 0; i < o.samples; ++i) {
+        char wav[4096];
+        snprintf(wav, sizeof(wav), "%s/s%zu.wav", o.dir, i);
+        writewav(wav, o.samplelen / 2 + rand() % (o.samplelen + 1), 55.0f * (1 + i % 24));
+        fprintf(f, "s%zu = load(\"%s\")\n", i, wav);
+    }
+
+    // bpm changes are spread evenly over every pattern
+    size_t every = o.rows / (o.bpmchanges + 1);
+    for (size_t p = 0; p < o.patterns; ++p) {
+        fprintf(f, "p%zu = {\n", p);
+        for (size_t r = 0; r < o.rows; ++r) {
+            if (every > 0 && r > 0 && r % every == 0 && r / every <= o.bpmchanges) {
+                fprintf(f, "set_bpm(%d) ", 100 + rand() % 80);
+            }
+            // Up to 4 hits per row, each with `density` probability
+            for (int h = 0; h < 4; ++h) {
+                if ((float)rand() / RAND_MAX < o.density) {
+                    fprintf(f, "s%zu ", (size_t)rand() % o.samples);
+                }
+            }
+            fprintf(f, "\n");
+        }
+        fprintf(f, "}\n");
+    }
+
+    // Songs repeat patterns a lot, so do the generated ones
+    for (size_t i = 0; i < o.sequence; i += 16) {
+        fprintf(f, "add_to_sequence(");
+        for (size_t j = i; j < o.sequence && j < i + 16; ++j) {
+            fprintf(f, "%sp%zu", j > i ? ", " : "", (size_t)rand() % o.patterns);
+        }
+        fprintf(f, ")\n");
+    }
+    fclose(f);
+    printf("%s\n", path);
+    return 0;
+}
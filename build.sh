@@ -2,6 +2,16 @@
 
 set -xe
 
-mkdir -p bin
-cc -ggdb -Wall -Wextra -o bin/trang src/lexer.c src/audio.c src/parser.c src/main.c -lm -lsndfile
+SRC="src/arena.c src/lexer.c src/audio.c src/render.c src/mix.c src/fx.c src/symtab.c src/samplecache.c src/resample.c src/watch.c src/stats.c src/parser.c src/project.c src/batch.c"
 
+mkdir -p bin
+if [ "$1" = "bench" ]; then
+    # Optimized build of the benchmark driver and the workload generator, then one
+    # run on a generated song. Every result is one line of JSON on stdout.
+    cc -O2 -Wall -Wextra -o bin/trang-gen bench/gen.c -lm
+    cc -O2 -Wall -Wextra -o bin/trang-bench bench/bench.c $SRC -lm -lpthread -lsndfile
+    ./bin/trang-gen -o bench/work -samples 64 -patterns 32 -rows 64 -density 0.3 -bpm-changes 2 -sequence 256 > /dev/null
+    TRANG_CACHE_DIR= ./bin/trang-bench bench/work/song.trang
+    exit 0
+fi
+cc -ggdb -Wall -Wextra -o bin/trang $SRC src/main.c -lm -lpthread -lsndfile
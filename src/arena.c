@@ -0,0 +1,83 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "stats.h"
+
+#define ARENA_ALIGN 16
+
+static size_t alignup(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+    size = alignup(size);
+    ArenaChunk *c = a->head;
+    if (c == NULL || c->size - c->used < size) {
+        size_t chunksz = size > ARENA_CHUNK_SZ ? size : ARENA_CHUNK_SZ;
+        if (a->spare != NULL && a->spare->size >= size) {
+            c = a->spare;
+            a->spare = c->next;
+        } else {
+            c = malloc(sizeof(ArenaChunk) + chunksz);
+            if (c == NULL) {
+                fprintf(stderr, "Error: out of memory\n");
+                exit(1);
+            }
+            stats_count(CT_ALLOCS, 1);
+            c->size = chunksz;
+        }
+        c->next = a->head;
+        c->used = 0;
+        a->head = c;
+    }
+    void *ptr = c->data + c->used;
+    c->used += size;
+    return ptr;
+}
+
+void *arena_realloc(Arena *a, void *old, size_t oldsize, size_t newsize) {
+    ArenaChunk *c = a->head;
+    if (old != NULL && c != NULL && (char*)old + alignup(oldsize) == c->data + c->used
+            && (char*)old - c->data + alignup(newsize) <= c->size) {
+        c->used = (char*)old - c->data + alignup(newsize);
+        return old;
+    }
+    void *ptr = arena_alloc(a, newsize);
+    if (old != NULL) {
+        memcpy(ptr, old, oldsize < newsize ? oldsize : newsize);
+    }
+    return ptr;
+}
+
+ArenaMark arena_mark(const Arena *a) {
+    return (ArenaMark){ a->head, a->head != NULL ? a->head->used : 0 };
+}
+
+void arena_rewind(Arena *a, ArenaMark m) {
+    while (a->head != m.chunk) {
+        ArenaChunk *c = a->head;
+        a->head = c->next;
+        c->next = a->spare;
+        a->spare = c;
+    }
+    if (a->head != NULL) {
+        a->head->used = m.used;
+    }
+}
+
+static void freechunks(ArenaChunk *c) {
+    while (c != NULL) {
+        ArenaChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+}
+
+void arena_free(Arena *a) {
+    freechunks(a->head);
+    freechunks(a->spare);
+    a->head = NULL;
+    a->spare = NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stdlib.h>
+
+#define ARENA_CHUNK_SZ (64 * 1024)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+// Bump allocator for things that all die together. Nothing is freed on its own,
+// arena_free() releases every chunk at once. Chunks emptied by arena_rewind() are
+// kept in `spare` for the next allocations.
+typedef struct {
+    ArenaChunk *head;
+    ArenaChunk *spare;
+} Arena;
+
+// Where the arena was at some point, arena_rewind() goes back there
+typedef struct {
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+void *arena_alloc(Arena *a, size_t size);
+// Grows in place when `old` is the last allocation, copies otherwise
+void *arena_realloc(Arena *a, void *old, size_t oldsize, size_t newsize);
+ArenaMark arena_mark(const Arena *a);
+// Drops everything allocated since the mark was taken. An allocation from before
+// the mark must not have grown with arena_realloc() since.
+void arena_rewind(Arena *a, ArenaMark m);
+void arena_free(Arena *a);
+
+#endif
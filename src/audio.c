@@ -1,200 +1,846 @@
+#include <stdio.h>
 #include <math.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <sndfile.h>
 
 #include "audio.h"
+#include "lexer.h"
+#include "samplecache.h"
+#include "resample.h"
+#include "mix.h"
+#include "stats.h"
 
 // TODO: combine into a structure?
 static Samples samples;
 static Patterns patterns;
-static float bpm = DEFAULT_BPM;
 Sequence sequence;
+static Effects masterfx;
+PlanOptions planopts;
 
-static size_t framesperrow() {
+// References on decoded frames, see DecodedSample
+static void holdframes(const Frame *frames);
+static void releaseframes(const Frame *frames);
+
+static size_t framesperrow(float bpm) {
     //       60 seconds per minute
     // ---------------------------------- * samples per second (or sample rate) * 2 samples per channel
     // 4 rows per beat * beats per minute
     return (60 / 4 / (float)bpm) * SAMPLE_RATE * 2;
 }
 
-static size_t rowtoframe(size_t row) {
-    return row * framesperrow();
+static size_t rowtoframe(size_t row, float bpm) {
+    return row * framesperrow(bpm);
 }
 
-static size_t framecount(const Pattern *p) {
-    size_t total_frames = 0, frames, offset = 0, ralbc = 0, oldbpm = bpm;
-    for (size_t i = 0; i < p->count; ++i) {
-        AudioObject ao = p->items[i];
-        if (ao.sample != NULL) {
-            frames = offset + rowtoframe(ao.row - ralbc) + ao.sample->count;
-            total_frames = frames > total_frames ? frames : total_frames;
-        }
-        if (ao.pc.type == PT_BPM) {
-            offset += rowtoframe(ao.row - ralbc);
-            bpm = ao.pc.value;
-            ralbc = ao.row;
-        }
+void addsampleinstance(size_t sample_name, Pattern *pat, size_t row, float pitch, float gain) {
+    size_t s = symbol(sample_name)->sample;
+    if (s == SYM_NONE) {
+        fprintf(stderr, "Error: no sample named %s\n", symname(sample_name));
+        lex_fail();
     }
-    // size_t min_frames = rowtoframecount(p->rows) - 1;
-    // total_frames = total_frames > min_frames ? total_frames : min_frames;
-    bpm = oldbpm;
-    return total_frames;
+
+    AudioObject ao = { .sample=s, .row=row, .pitch=pitch, .gain=gain };
+    DA_APPEND(pat, ao);
 }
 
-static float addsounds(float s1, float s2) {
-    return ((double)s1 - (0xFFFF / 2 - 1) + (double)s2 - (0xFFFF / 2 - 1)) / 2 + (0xFFFF / 2 - 1);
+void addbpmchange(float value, Pattern *pat, size_t row) {
+    ParameterChange pc  = { .type=PT_BPM, .value=value };
+    AudioObject ao = { .sample=SYM_NONE, .pc=pc, .row=row };
+    DA_APPEND(pat, ao);
 }
 
-void addsampleinstance(const char *sample_name, Pattern *pat, size_t row) {
-    Sample *s = NULL;
+size_t beginloop(Pattern *pat, size_t row, size_t times) {
+    Loop lp = { .row=row, .times=times, .first=pat->count };
+    DA_APPEND(&pat->loops, lp);
+    return pat->loops.count - 1;
+}
 
-    for (size_t i = 0; i < samples.count; ++i) {
-        if (!strcmp(samples.items[i].name, sample_name)) {
-            s = &samples.items[i];
-            break;
+void endloop(Pattern *pat, size_t loop, size_t period) {
+    Loop *lp = &pat->loops.items[loop];
+    lp->period = period;
+    lp->count = pat->count - lp->first;
+    lp->nested = pat->loops.count - loop - 1;
+}
+
+void addevery(size_t sample_name, Pattern *pat, size_t row, size_t period, float pitch, float gain) {
+    size_t loop = beginloop(pat, row, 0);
+    addsampleinstance(sample_name, pat, 0, pitch, gain);
+    endloop(pat, loop, period);
+}
+
+void endbody(Pattern *pat, size_t firstloop, size_t rows) {
+    for (size_t i = firstloop; i < pat->loops.count; i += pat->loops.items[i].nested + 1) {
+        Loop *lp = &pat->loops.items[i];
+        if (lp->times == 0 && lp->row < rows) {
+            lp->times = (rows - lp->row + lp->period - 1) / lp->period;
         }
     }
-    if (s == NULL) {
-        fprintf(stderr, "Error: no sample named %s\n", sample_name);
-        exit(1);
+}
+
+// Appends items [first, first + count) with the loops [loop, loop + nloops)
+// among them played out, rows counting from `base`
+static void expanditems(const Pattern *pat, size_t first, size_t count, size_t loop, size_t nloops, size_t base, AudioObjects *out) {
+    size_t i = first;
+    for (size_t li = loop; li < loop + nloops; li += pat->loops.items[li].nested + 1) {
+        const Loop *lp = &pat->loops.items[li];
+        for (; i < lp->first; ++i) {
+            AudioObject ao = pat->items[i];
+            ao.row += base;
+            DA_APPEND_COUNTED(out, ao);
+        }
+        for (size_t t = 0; t < lp->times; ++t) {
+            expanditems(pat, lp->first, lp->count, li + 1, lp->nested, base + lp->row + t * lp->period, out);
+        }
+        i = lp->first + lp->count;
     }
+    for (; i < first + count; ++i) {
+        AudioObject ao = pat->items[i];
+        ao.row += base;
+        DA_APPEND_COUNTED(out, ao);
+    }
+}
 
-    AudioObject ao = { .sample=s, .row=row };
-    DA_APPEND(pat, ao);
+// Stable merge sort by row, items on the same row keep the order they were written in
+static void sortrows(AudioObject *items, AudioObject *tmp, size_t n) {
+    for (size_t width = 1; width < n; width *= 2) {
+        for (size_t lo = 0; lo < n; lo += 2 * width) {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+            size_t a = lo, b = mid, k = lo;
+            while (a < mid && b < hi) tmp[k++] = items[b].row < items[a].row ? items[b++] : items[a++];
+            while (a < mid) tmp[k++] = items[a++];
+            while (b < hi) tmp[k++] = items[b++];
+        }
+        memcpy(items, tmp, n * sizeof(AudioObject));
+    }
 }
 
-void addbpmchange(float value, Pattern *pat, size_t row) {
-    ParameterChange pc  = { .type=PT_BPM, .value=value };
-    AudioObject ao = { .sample=NULL, .pc=pc, .row=row };
-    DA_APPEND(pat, ao);
+// The items of the pattern in row order with every loop played out
+static AudioObjects expandpattern(const Pattern *pat) {
+    AudioObjects out = {0};
+    size_t nloops = pat->loops.count;
+    expanditems(pat, 0, pat->count, 0, nloops, 0, &out);
+    AudioObject *tmp = malloc((out.count + 1) * sizeof(AudioObject));
+    assert(tmp != NULL);
+    sortrows(out.items, tmp, out.count);
+    free(tmp);
+    return out;
 }
 
-float sinsound(float i, float freq, float volume, float samplerate) {
-    return sinf(i * M_PI * 2 * freq / samplerate) * volume * (0xFFFF / 2 - 1);
+static void planpush(RenderPlan *plan, size_t start, size_t sample, const AudioObject *ao) {
+    if (plan->events.count >= plan->events.capacity) {
+        size_t cap = plan->events.capacity ? plan->events.capacity * 2 : DA_INIT_CAP;
+        plan->events.start = realloc(plan->events.start, cap * sizeof(size_t));
+        plan->events.sample = realloc(plan->events.sample, cap * sizeof(size_t));
+        plan->events.length = realloc(plan->events.length, cap * sizeof(size_t));
+        plan->events.cut = realloc(plan->events.cut, cap * sizeof(size_t));
+        plan->events.fade = realloc(plan->events.fade, cap * sizeof(size_t));
+        plan->events.step = realloc(plan->events.step, cap * sizeof(double));
+        plan->events.gain = realloc(plan->events.gain, cap * sizeof(float));
+        assert(plan->events.start && plan->events.sample && plan->events.length && plan->events.cut);
+        assert(plan->events.fade && plan->events.step && plan->events.gain);
+        plan->events.capacity = cap;
+        stats_count(CT_ALLOCS, 1);
+    }
+    size_t i = plan->events.count++;
+    assert(i == 0 || plan->events.start[i - 1] <= start);
+    plan->events.start[i] = start;
+    // A sample pitched up plays faster and ends sooner: its last frame is the last
+    // one whose position still lands inside the sample
+    size_t length = plan->samples[sample].count;
+    double step = ao->pitch == 0 ? 1.0 : pow(2, ao->pitch / 12.0);
+    if (step != 1.0 && length > 0) {
+        length = ((size_t)((length / 2 - 1) / step) + 1) * 2;
+    }
+    plan->events.sample[i] = sample;
+    plan->events.length[i] = length;
+    plan->events.cut[i] = NO_CUT;
+    plan->events.fade[i] = VOICE_FADE_FRAMES;
+    plan->events.step[i] = step;
+    plan->events.gain[i] = ao->gain;
+    size_t end = start + length;
+    plan->total_frames = end > plan->total_frames ? end : plan->total_frames;
 }
 
-float raisepitch(float base, float semitones) {
-    return base * pow(2, 1/semitones);
+// Starts the fade out of event e at frame `at`, unless it already fades
+static bool cutevent(RenderPlan *plan, size_t e, size_t at) {
+    size_t off = at - plan->events.start[e];
+    if (plan->events.cut[e] != NO_CUT && plan->events.cut[e] <= off) {
+        return false;
+    }
+    plan->events.cut[e] = off;
+    if (off + VOICE_FADE_FRAMES < plan->events.length[e]) {
+        plan->events.length[e] = off + VOICE_FADE_FRAMES;
+    }
+    return true;
 }
 
-size_t saveaudio(const char *filepath) {
-    if (patterns.count == 0) {
-        return 0;
+// Applies the choke groups and the voice limit to the events. When there are
+// too many voices the oldest one is faded out, and fading voices are capped the
+// same way: the oldest fades get steeper and end VOICE_MIN_FADE_FRAMES later.
+// Apart from those last few frames no more than 2 * planopts.voices events ever
+// overlap. Returns whether anything was cut.
+static bool limitvoices(RenderPlan *plan) {
+    bool chokes = false;
+    for (size_t i = 0; i < plan->nsamples; ++i) {
+        chokes = chokes || plan->samples[i].choke != 0;
     }
-    SF_INFO sfinfo;
-    sfinfo.samplerate = SAMPLE_RATE;
-    sfinfo.channels = 2;
-    sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16 | SF_ENDIAN_FILE;
-    SNDFILE *file = sf_open(filepath, SFM_WRITE, &sfinfo);
-    if (file == NULL) {
-        fprintf(stderr, "Error while opening the file %s: %s\n", filepath, sf_strerror(file));
-        exit(1);
+    if (!chokes && planopts.voices == 0) {
+        return false;
     }
 
-    size_t total_frames = 0, offset = 0, ralbc = 0;
-    Frame *buf = NULL;
+    // Events that still play at the current one, oldest first
+    struct {
+        size_t *items;
+        size_t count;
+        size_t capacity;
+    } active = {0};
+    size_t cuts = 0;
+    for (size_t e = 0; e < plan->events.count; ++e) {
+        size_t at = plan->events.start[e];
+        size_t choke = plan->samples[plan->events.sample[e]].choke;
+        size_t kept = 0, live = 0, fading = 0;
+        for (size_t i = 0; i < active.count; ++i) {
+            size_t a = active.items[i];
+            if (plan->events.start[a] + plan->events.length[a] <= at) continue;
+            if (choke != 0 && plan->samples[plan->events.sample[a]].choke == choke) {
+                cuts += cutevent(plan, a, at);
+            }
+            active.items[kept++] = a;
+            if (plan->events.cut[a] == NO_CUT) live++;
+            else fading++;
+        }
+        active.count = kept;
+
+        if (planopts.voices > 0 && live >= planopts.voices) {
+            for (size_t i = 0; i < active.count; ++i) {
+                if (plan->events.cut[active.items[i]] == NO_CUT) {
+                    cuts += cutevent(plan, active.items[i], at);
+                    fading++;
+                    break;
+                }
+            }
+        }
+        // Too many fades at once, the oldest ones finish their fade right after
+        // this frame. Stopping them here would click.
+        kept = 0;
+        for (size_t i = 0; i < active.count; ++i) {
+            size_t a = active.items[i];
+            if (planopts.voices > 0 && fading > planopts.voices && plan->events.cut[a] != NO_CUT) {
+                size_t fade = at - plan->events.start[a] - plan->events.cut[a] + VOICE_MIN_FADE_FRAMES;
+                if (fade < plan->events.fade[a]) {
+                    plan->events.fade[a] = fade;
+                }
+                if (plan->events.cut[a] + plan->events.fade[a] < plan->events.length[a]) {
+                    plan->events.length[a] = plan->events.cut[a] + plan->events.fade[a];
+                }
+                fading--;
+                continue;
+            }
+            active.items[kept++] = a;
+        }
+        active.count = kept;
+        DA_APPEND_COUNTED(&active, e);
+    }
+    free(active.items);
+    stats_count(CT_CUTS, cuts);
+    if (cuts == 0) {
+        return false;
+    }
+
+    plan->total_frames = 0;
+    for (size_t e = 0; e < plan->events.count; ++e) {
+        size_t end = plan->events.start[e] + plan->events.length[e];
+        plan->total_frames = end > plan->total_frames ? end : plan->total_frames;
+    }
+    return true;
+}
+
+// An occurrence with a cut event no longer plays what the other occurrences of
+// its pattern play, so it gets a render of its own that is never cached
+static void splitrenders(RenderPlan *plan) {
+    for (size_t r = 0; r < plan->renders.count; ++r) {
+        plan->renders.items[r].uses = 0;
+        plan->renders.items[r].occurrence = SYM_NONE;
+    }
+    for (size_t pi = 0; pi < plan->patterns.count; ++pi) {
+        PlanPattern *pp = &plan->patterns.items[pi];
+        bool cut = false;
+        for (size_t e = pp->first; e < pp->first + pp->count && !cut; ++e) {
+            cut = plan->events.cut[e] != NO_CUT;
+        }
+        if (cut) {
+            PatternRender *old = &plan->renders.items[pp->render];
+            PatternRender nr = { .pattern = old->pattern, .bpm = old->bpm, .next = SYM_NONE, .occurrence = pi, .uses = 1 };
+            DA_APPEND_COUNTED(&plan->renders, nr);
+            pp->render = plan->renders.count - 1;
+            continue;
+        }
+        PatternRender *r = &plan->renders.items[pp->render];
+        if (r->occurrence == SYM_NONE) r->occurrence = pi;
+        r->uses++;
+    }
+}
+
+static Effects copyeffects(const Effects *fx) {
+    Effects copy = {0};
+    for (size_t i = 0; i < fx->count; ++i) {
+        DA_APPEND(&copy, fx->items[i]);
+    }
+    return copy;
+}
+
+void buildplan(RenderPlan *plan) {
+    uint64_t start = stats_begin();
+    *plan = (RenderPlan){0};
+    plan->nsamples = samples.count;
+    plan->samples = malloc((samples.count + 1) * sizeof(Sample));
+    assert(plan->samples != NULL);
+    memcpy(plan->samples, samples.items, samples.count * sizeof(Sample));
+    // The plan keeps the decoded frames and its own copy of the paths alive
+    // after resetproject(). The effects are already applied to the frames.
+    for (size_t i = 0; i < plan->nsamples; ++i) {
+        Sample *s = &plan->samples[i];
+        holdframes(s->frames);
+        s->path = strdup(s->path);
+        assert(s->path != NULL);
+        s->fx = (Effects){0};
+    }
+
+    // heads[p] is the first of the renders of pattern p, chained through `next`
+    size_t *heads = malloc((patterns.count + 1) * sizeof(size_t));
+    assert(heads != NULL);
+    for (size_t i = 0; i < patterns.count; ++i) heads[i] = SYM_NONE;
+
+    // busof[p] is the effect bus of pattern p once it got one
+    size_t *busof = malloc((patterns.count + 1) * sizeof(size_t));
+    plan->buses = calloc(patterns.count + 1, sizeof(Effects));
+    assert(busof != NULL && plan->buses != NULL);
+    for (size_t i = 0; i < patterns.count; ++i) busof[i] = SYM_NONE;
+    plan->masterfx = copyeffects(&masterfx);
+
+    // Patterns with loops are played out the first time they come up in the sequence
+    AudioObjects *expanded = calloc(patterns.count + 1, sizeof(AudioObjects));
+    bool *isexpanded = calloc(patterns.count + 1, sizeof(bool));
+    assert(expanded != NULL && isexpanded != NULL);
+
+    float bpm = DEFAULT_BPM;
+    size_t offset = 0;
+    size_t row = 0;
     for (size_t pi = 0; pi < sequence.count; ++pi) {
-        Pattern *pat = sequence.items[pi];
-        size_t sum = offset + framecount(pat);
-        total_frames = sum > total_frames ? sum : total_frames;
-        if (pat->count == 0) {
+        size_t idx = sequence.items[pi];
+        Pattern *pat = &patterns.items[idx];
+        const AudioObject *items = pat->items;
+        size_t count = pat->count;
+        if (pat->loops.count > 0) {
+            if (!isexpanded[idx]) {
+                expanded[idx] = expandpattern(pat);
+                isexpanded[idx] = true;
+            }
+            items = expanded[idx].items;
+            count = expanded[idx].count;
+        }
+        if (count == 0) {
             continue;
         }
-        buf = (Frame*)realloc(buf, total_frames * sizeof(Frame));
 
-        if (buf == NULL) {
-            fprintf(stderr, "Error while allocation memory for the final audio: %s\n", strerror(errno));
-            sf_close(file);
-            exit(1);
+        size_t r = heads[idx];
+        while (r != SYM_NONE && plan->renders.items[r].bpm != bpm) {
+            r = plan->renders.items[r].next;
         }
+        if (r == SYM_NONE) {
+            PatternRender nr = { .pattern = idx, .bpm = bpm, .next = heads[idx], .occurrence = plan->patterns.count };
+            DA_APPEND_COUNTED(&plan->renders, nr);
+            r = heads[idx] = plan->renders.count - 1;
+        }
+        plan->renders.items[r].uses++;
+        if (pat->fx.count > 0 && busof[idx] == SYM_NONE) {
+            plan->buses[plan->nbuses] = copyeffects(&pat->fx);
+            busof[idx] = plan->nbuses++;
+        }
+        PlanPattern pp = { .pattern = idx, .start = offset, .first = plan->events.count, .render = r, .bus = busof[idx] };
+        TempoSegment seg = { .row = row, .frame = offset, .bpm = bpm };
+        DA_APPEND_COUNTED(&plan->tempo, seg);
 
-        for (size_t si = 0; si < pat->count; ++si) {
-            AudioObject ao = pat->items[si];
-            Sample *s = ao.sample;
-            if (s != NULL) {
-                assert(ao.row >= ralbc);
-                size_t pos = offset + rowtoframe(ao.row - ralbc);
-                for (size_t fi = 0; fi < s->count; ++fi) {
-                    buf[pos + fi] = addsounds(buf[pos + fi], s->frames[fi]);
-                }
+        size_t ralbc = 0;
+        for (size_t i = 0; i < count; ++i) {
+            AudioObject ao = items[i];
+            assert(ao.row >= ralbc);
+            size_t pos = offset + rowtoframe(ao.row - ralbc, bpm);
+            if (ao.sample != SYM_NONE) {
+                assert(samples.items[ao.sample].frames != NULL);
+                planpush(plan, pos, ao.sample, &ao);
             }
             if (ao.pc.type == PT_BPM) {
-                offset += rowtoframe(ao.row - ralbc);
+                offset = pos;
                 bpm = ao.pc.value;
                 ralbc = ao.row;
+                TempoSegment seg = { .row = row + ao.row, .frame = pos, .bpm = bpm };
+                DA_APPEND_COUNTED(&plan->tempo, seg);
             }
         }
         assert(pat->rows >= ralbc);
-        offset += (pat->rows - ralbc) * framesperrow();
-        ralbc = 0;
+        offset += (pat->rows - ralbc) * framesperrow(bpm);
+        row += pat->rows;
+        pp.count = plan->events.count - pp.first;
+        DA_APPEND_COUNTED(&plan->patterns, pp);
     }
-    if (total_frames % 2 != 0) total_frames ++;
-    if ((int) total_frames != sf_write_float(file, buf, total_frames)) {
-        fprintf(stderr, "Error while writing to the file %s: %s\n", filepath, sf_strerror(file));
-        sf_close(file);
-        exit(1);
+    free(heads);
+    free(busof);
+    for (size_t i = 0; i < patterns.count; ++i) {
+        free(expanded[i].items);
+    }
+    free(expanded);
+    free(isexpanded);
+    if (limitvoices(plan)) {
+        splitrenders(plan);
+    }
+    for (size_t pi = 0; pi < plan->patterns.count; ++pi) {
+        PlanPattern *pp = &plan->patterns.items[pi];
+        pp->end = pp->start;
+        for (size_t e = pp->first; e < pp->first + pp->count; ++e) {
+            size_t end = plan->events.start[e] + plan->events.length[e];
+            pp->end = end > pp->end ? end : pp->end;
+        }
+        plan->maxspan = pp->end - pp->start > plan->maxspan ? pp->end - pp->start : plan->maxspan;
     }
+    // Delays on a bus keep ringing after its pattern ends, the master's after
+    // everything else did. The song lasts until they are done.
+    for (size_t pi = 0; pi < plan->patterns.count; ++pi) {
+        const PlanPattern *pp = &plan->patterns.items[pi];
+        if (pp->bus == SYM_NONE) continue;
+        size_t end = pp->end + fx_tail(plan->buses[pp->bus].items, plan->buses[pp->bus].count);
+        plan->total_frames = end > plan->total_frames ? end : plan->total_frames;
+    }
+    plan->total_frames += fx_tail(plan->masterfx.items, plan->masterfx.count);
+    TempoSegment last = { .row = row, .frame = offset, .bpm = bpm };
+    DA_APPEND_COUNTED(&plan->tempo, last);
+    stats_end(PH_PLAN, start);
+}
 
-    sf_close(file);
+void freeplan(RenderPlan *plan) {
+    free(plan->events.start);
+    free(plan->events.sample);
+    free(plan->events.length);
+    free(plan->events.cut);
+    free(plan->events.fade);
+    free(plan->events.step);
+    free(plan->events.gain);
+    for (size_t i = 0; i < plan->renders.count; ++i) {
+        free(plan->renders.items[i].frames);
+    }
+    free(plan->renders.items);
+    free(plan->patterns.items);
+    free(plan->tempo.items);
+    for (size_t i = 0; i < plan->nsamples; ++i) {
+        releaseframes(plan->samples[i].frames);
+        free(plan->samples[i].path);
+    }
+    free(plan->samples);
+    for (size_t i = 0; i < plan->nbuses; ++i) {
+        free(plan->buses[i].items);
+    }
+    free(plan->buses);
+    free(plan->masterfx.items);
+    *plan = (RenderPlan){0};
+}
 
-    return total_frames;
+size_t planrowframe(const RenderPlan *plan, size_t row) {
+    if (plan->tempo.count == 0) {
+        return rowtoframe(row, DEFAULT_BPM);
+    }
+    // Last segment that starts at or before the row
+    size_t lo = 0, hi = plan->tempo.count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (plan->tempo.items[mid].row <= row) lo = mid;
+        else hi = mid;
+    }
+    const TempoSegment *seg = &plan->tempo.items[lo];
+    return seg->frame + rowtoframe(row - seg->row, seg->bpm);
 }
 
-void loadsample(const char *path, const char *name) {
-    SF_INFO sfinfo;
-    sfinfo.format = 0;
-    SNDFILE *file = sf_open(path, SFM_READ, &sfinfo);
-    if (file == NULL) {
-        fprintf(stderr, "Error while opening the file %s: %s\n", path, sf_strerror(file));
-        exit(1);
+bool planeffects(const RenderPlan *plan) {
+    return plan->nbuses > 0 || plan->masterfx.count > 0;
+}
+
+size_t planseek(const RenderPlan *plan, size_t frame) {
+    // Occurrences are sorted by start and none lasts longer than maxspan, so
+    // anything that starts maxspan before the frame is already over
+    size_t lo = 0, hi = plan->patterns.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (plan->patterns.items[mid].start + plan->maxspan <= frame) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Every file decoded by this process, so samples loaded from the same path (in
+// one script or across re-parses) share their frames. `fx` tells the frames with
+// effects applied apart from the plain ones, which have 0. `refs` counts the
+// samples of the project and of the plans that use the frames. Once it drops to
+// 0 they are freed, unless they are the plain frames of the file as it is now:
+// those are kept for the next script or re-parse.
+typedef struct {
+    char *path;
+    off_t size;
+    struct timespec mtime;
+    uint64_t fx;
+    Frame *frames;
+    size_t count;
+    size_t refs;
+    // A newer version of the file was decoded since
+    bool stale;
+} DecodedSample;
+DA(DecodedSample)
+
+static DecodedSamples decoded;
+static pthread_mutex_t decodedlock = PTHREAD_MUTEX_INITIALIZER;
+
+// Needs decodedlock
+static void dropdecoded(size_t i) {
+    DecodedSample *d = &decoded.items[i];
+    if (!samplecache_unload(d->frames)) {
+        free(d->frames);
+    }
+    free(d->path);
+    decoded.items[i] = decoded.items[--decoded.count];
+}
+
+// Needs decodedlock
+static bool unused(const DecodedSample *d) {
+    return d->refs == 0 && (d->stale || d->fx != 0);
+}
+
+static void holdframes(const Frame *frames) {
+    if (frames == NULL) return;
+    pthread_mutex_lock(&decodedlock);
+    for (size_t i = 0; i < decoded.count; ++i) {
+        if (decoded.items[i].frames == frames) {
+            decoded.items[i].refs++;
+            break;
+        }
     }
-    size_t items = sfinfo.frames * sfinfo.channels;
-    Frame *frame_buf = (Frame*) calloc(items, sizeof(Frame));
-    if ((int)items != sf_read_float(file, frame_buf, items)) {
-        fprintf(stderr, "Error while reading from the file %s: %s\n", path, sf_strerror(file));
+    pthread_mutex_unlock(&decodedlock);
+}
+
+static void releaseframes(const Frame *frames) {
+    if (frames == NULL) return;
+    pthread_mutex_lock(&decodedlock);
+    for (size_t i = 0; i < decoded.count; ++i) {
+        DecodedSample *d = &decoded.items[i];
+        if (d->frames == frames) {
+            assert(d->refs > 0);
+            d->refs--;
+            if (unused(d)) dropdecoded(i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&decodedlock);
+}
+
+// The sample gets a reference on the frames it finds
+static bool finddecoded(Sample *s, const struct stat *st, uint64_t fx) {
+    bool found = false;
+    pthread_mutex_lock(&decodedlock);
+    for (size_t i = 0; i < decoded.count; ++i) {
+        DecodedSample *d = &decoded.items[i];
+        if (d->fx == fx && !strcmp(d->path, s->path) && d->size == st->st_size
+                && d->mtime.tv_sec == st->st_mtim.tv_sec && d->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            s->frames = d->frames;
+            s->count = d->count;
+            d->refs++;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&decodedlock);
+    return found;
+}
+
+// Returns false when the file can't be decoded, after saying why
+static bool decodefile(Sample *s) {
+    size_t items;
+    uint64_t start = stats_begin();
+    Frame *frame_buf = samplecache_load(s->path, &items);
+    if (frame_buf == NULL) {
+        SF_INFO sfinfo;
+        sfinfo.format = 0;
+        SNDFILE *file = sf_open(s->path, SFM_READ, &sfinfo);
+        if (file == NULL) {
+            fprintf(stderr, "Error while opening the file %s: %s\n", s->path, sf_strerror(file));
+            return false;
+        }
+        items = sfinfo.frames * sfinfo.channels;
+        frame_buf = (Frame*) calloc(items, sizeof(Frame));
+        stats_count(CT_ALLOCS, 1);
+        if ((int)items != sf_read_float(file, frame_buf, items)) {
+            fprintf(stderr, "Error while reading from the file %s: %s\n", s->path, sf_strerror(file));
+            sf_close(file);
+            free(frame_buf);
+            return false;
+        }
+        sf_close(file);
+        stats_count(CT_BYTES_DECODED, items * sizeof(Frame));
+        // The renderer only knows stereo at SAMPLE_RATE
+        if (sfinfo.samplerate != SAMPLE_RATE || sfinfo.channels != 2) {
+            Frame *converted = resample(frame_buf, sfinfo.frames, sfinfo.channels, sfinfo.samplerate, &items);
+            free(frame_buf);
+            frame_buf = converted;
+        }
+        samplecache_store(s->path, frame_buf, items);
+    }
+    stats_end(PH_DECODE, start);
+    s->frames = frame_buf;
+    s->count = items;
+    return true;
+}
+
+// Stores the frames of the sample, which keeps its reference on them. Older
+// versions of the same file with the same effects are stale from now on.
+static void remember(const Sample *s, const struct stat *st, uint64_t fx) {
+    DecodedSample d = { .path = strdup(s->path), .size = st->st_size, .mtime = st->st_mtim, .fx = fx, .frames = s->frames, .count = s->count, .refs = 1 };
+    assert(d.path != NULL);
+    pthread_mutex_lock(&decodedlock);
+    for (size_t i = decoded.count; i-- > 0;) {
+        DecodedSample *old = &decoded.items[i];
+        if (old->fx == fx && !strcmp(old->path, d.path)) {
+            old->stale = true;
+            if (unused(old)) dropdecoded(i);
+        }
+    }
+    DA_APPEND(&decoded, d);
+    pthread_mutex_unlock(&decodedlock);
+}
+
+// The decoded frames stay as they are, the sample gets a copy with the effects
+// and their tail
+static void applyeffects(Sample *s) {
+    uint64_t start = stats_begin();
+    size_t tail = fx_tail(s->fx.items, s->fx.count);
+    Frame *out = calloc(s->count + tail + 1, sizeof(Frame));
+    stats_count(CT_ALLOCS, 1);
+    if (out == NULL) {
+        fprintf(stderr, "Error while allocation memory for the sample %s: %s\n", s->path, strerror(errno));
         exit(1);
     }
-    sf_close(file);
+    memcpy(out, s->frames, s->count * sizeof(Frame));
+    FxChain chain;
+    fx_init(&chain, s->fx.items, s->fx.count, MIX_HEADROOM);
+    fx_process(&chain, out, s->count + tail);
+    fx_free(&chain);
+    s->frames = out;
+    s->count += tail;
+    stats_end(PH_DECODE, start);
+}
+
+static bool loadframes(Sample *s) {
+    struct stat st;
+    bool known = stat(s->path, &st) == 0;
+    uint64_t fx = fx_signature(s->fx.items, s->fx.count);
+    if (known && finddecoded(s, &st, fx)) {
+        return true;
+    }
+    if (!known || !finddecoded(s, &st, 0)) {
+        if (!decodefile(s)) return false;
+        if (known) remember(s, &st, 0);
+    }
+    if (fx != 0) {
+        // The plain frames are held until the copy with the effects is made
+        const Frame *plain = s->frames;
+        applyeffects(s);
+        releaseframes(plain);
+        if (known) remember(s, &st, fx);
+    }
+    return true;
+}
 
-    Sample *s = NULL;
-    LINEAR_SEARCH(samples, name, s);
-    if (s) {
-        s->frames = frame_buf;
+static bool silentframe(const Frame *f) {
+    return fabsf(f[0]) <= planopts.silence && fabsf(f[1]) <= planopts.silence;
+}
+
+// Leading and trailing silence of the sample, the renderer doesn't mix it
+static void trimsilence(Sample *s) {
+    size_t frames = s->count / 2;
+    size_t first = 0, last = frames;
+    while (first < frames && silentframe(s->frames + first * 2)) first++;
+    while (last > first && silentframe(s->frames + (last - 1) * 2)) last--;
+    s->lead = first * 2;
+    s->active = last * 2;
+}
+
+static bool decodesample(Sample *s) {
+    if (!loadframes(s)) return false;
+    trimsilence(s);
+    return true;
+}
+
+// Only records where the sample comes from, the file is decoded by loadsamples()
+void loadsample(const char *path, size_t name, size_t choke) {
+    char *p = strdup(path);
+    assert(p != NULL);
+    Symbol *sym = symbol(name);
+    if (sym->sample != SYM_NONE) {
+        Sample *s = &samples.items[sym->sample];
+        releaseframes(s->frames);
+        free(s->path);
+        s->path = p;
+        s->choke = choke;
+        s->frames = NULL;
+        s->count = 0;
     } else {
-        //printf("Adding sample %s\n", name);
-        Sample sample = {.frames = frame_buf, .count = items};
-        strcpy(sample.name, name);
+        //printf("Adding sample %s\n", symname(name));
+        Sample sample = {.name = name, .path = p, .choke = choke};
         DA_APPEND(&samples, sample);
+        sym->sample = samples.count - 1;
     }
 }
 
-void addpattern(Pattern *pat, const char *name) {
-    if (name) {
-        memcpy(pat->name, name, WORD_MAX_SZ - 1);
-    } else {
-        int numstrlength = snprintf(NULL, 0, "%zu", patterns.count);
+static struct {
+    size_t *todo;
+    size_t count;
+    size_t next;
+    bool failed;
+    pthread_mutex_t lock;
+} decodequeue = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void *decodeworker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&decodequeue.lock);
+        size_t i = decodequeue.next++;
+        pthread_mutex_unlock(&decodequeue.lock);
+        if (i >= decodequeue.count) break;
+        if (!decodesample(&samples.items[decodequeue.todo[i]])) {
+            pthread_mutex_lock(&decodequeue.lock);
+            decodequeue.failed = true;
+            pthread_mutex_unlock(&decodequeue.lock);
+        }
+    }
+    return NULL;
+}
+
+bool loadsamples(void) {
+    bool *used = calloc(samples.count + 1, sizeof(bool));
+    decodequeue.todo = malloc((samples.count + 1) * sizeof(size_t));
+    assert(used != NULL && decodequeue.todo != NULL);
+    decodequeue.count = 0;
+    decodequeue.next = 0;
+    decodequeue.failed = false;
+    for (size_t pi = 0; pi < sequence.count; ++pi) {
+        Pattern *pat = &patterns.items[sequence.items[pi]];
+        for (size_t i = 0; i < pat->count; ++i) {
+            size_t si = pat->items[i].sample;
+            if (si != SYM_NONE && !used[si]) {
+                used[si] = true;
+                if (samples.items[si].frames == NULL) {
+                    decodequeue.todo[decodequeue.count++] = si;
+                }
+            }
+        }
+    }
+
+    // resample() uses the mix kernels, pick them before the workers start
+    mix_init();
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = cpus > 0 ? (size_t)cpus : 1;
+    nthreads = nthreads < decodequeue.count ? nthreads : decodequeue.count;
+    pthread_t *threads = calloc(nthreads + 1, sizeof(pthread_t));
+    assert(threads != NULL);
+    size_t started = 0;
+    for (size_t i = 1; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, decodeworker, NULL) != 0) break;
+        started = i;
+    }
+    decodeworker(NULL);
+    for (size_t i = 1; i <= started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(decodequeue.todo);
+    free(used);
+    return !decodequeue.failed;
+}
+
+void addpattern(Pattern *pat, size_t name) {
+    if (name == SYM_NONE) {
+        char numstr[SYM_NAME_SZ];
+        int numstrlength = snprintf(numstr, sizeof(numstr), "%zu", patterns.count);
         assert(numstrlength >= 0);
-        assert(numstrlength <  WORD_MAX_SZ);
-        sprintf(pat->name, "%zu", patterns.count);
+        assert(numstrlength <  SYM_NAME_SZ);
+        name = intern(numstr);
     }
-    Pattern *p = NULL;
-    LINEAR_SEARCH(patterns, pat->name, p);
-    if (p) {
-        p->items = pat->items;
+    pat->name = name;
+    Symbol *sym = symbol(name);
+    if (sym->pattern != SYM_NONE) {
+        patterns.items[sym->pattern] = *pat;
     } else {
         DA_APPEND(&patterns, *pat);
+        sym->pattern = patterns.count - 1;
     }
 }
 
-void addtosequence(const char *pattern_name) {
-    Pattern *p = NULL;
-    LINEAR_SEARCH(patterns, pattern_name, p);
-    if (!p) {
-        fprintf(stderr, "Error: pattern not found: %s\n", pattern_name);
-        exit(1);
+void addtosequence(size_t pattern_name) {
+    size_t p = symbol(pattern_name)->pattern;
+    if (p == SYM_NONE) {
+        fprintf(stderr, "Error: pattern not found: %s\n", symname(pattern_name));
+        lex_fail();
     }
     DA_APPEND(&sequence, p);
 }
+
+void addeffect(EffectTarget target, size_t index, const Effect *fx) {
+    switch (target) {
+        case FXT_SAMPLE:
+            DA_APPEND(&samples.items[index].fx, *fx);
+            break;
+        case FXT_PATTERN:
+            DA_APPEND(&patterns.items[index].fx, *fx);
+            break;
+        default:
+            DA_APPEND(&masterfx, *fx);
+            break;
+    }
+}
+
+const Samples *projectsamples(void) {
+    return &samples;
+}
+
+const Patterns *projectpatterns(void) {
+    return &patterns;
+}
+
+const Sequence *projectsequence(void) {
+    return &sequence;
+}
+
+const Effects *projectmasterfx(void) {
+    return &masterfx;
+}
+
+void resetproject(void) {
+    for (size_t i = 0; i < patterns.count; ++i) {
+        free(patterns.items[i].items);
+        free(patterns.items[i].loops.items);
+        free(patterns.items[i].fx.items);
+    }
+    for (size_t i = 0; i < samples.count; ++i) {
+        releaseframes(samples.items[i].frames);
+        free(samples.items[i].path);
+        free(samples.items[i].fx.items);
+    }
+    masterfx.count = 0;
+    patterns.count = 0;
+    samples.count = 0;
+    sequence.count = 0;
+    sym_reset();
+}
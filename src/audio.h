@@ -2,8 +2,11 @@
 #define AUDIO_H_
 
 #include <stdlib.h>
+#include <stdbool.h>
 
 #include "util.h"
+#include "symtab.h"
+#include "fx.h"
 
 #define SAMPLE_RATE 44100
 #define DEFAULT_BPM 140
@@ -12,22 +15,46 @@ typedef float Frame;
 
 #define SAMPLE_CAP 1024
 #define SAMPLE_INSTANCE_CAP 1024
+// Largest shift in semitones a play() can ask for, either way. Four octaves down
+// already makes a sample 16 times longer.
+#define PITCH_RANGE 48
+
+// Number of floats (not stereo pairs) rendered and written at a time
+#define BLOCK_FRAMES 4096
+// Tile size used when the timeline is split between threads
+#define TILE_FRAMES (BLOCK_FRAMES * 16)
+
+// Length of the fade out of a voice that was choked or stolen
+#define VOICE_FADE_FRAMES 512
+// Shortest fade a voice gets when too many voices fade out at once
+#define VOICE_MIN_FADE_FRAMES 64
+// Cut offset of an event that plays to its end
+#define NO_CUT ((size_t)-1)
 
 #define WORD_MAX_SZ 64
 
-// TODO: generalize somehow
-#define LINEAR_SEARCH(arr, item_name, var) do {\
-    for (size_t iter = 0; iter < (arr).count; ++iter) {\
-        if (!strcmp((arr).items[iter].name, (item_name))) {\
-            (var) = &(arr).items[iter];\
-        }\
-    }\
-} while (0)
-
 typedef struct {
-    char name[WORD_MAX_SZ];
+    // Most voices (not counting the ones fading out) that may play at once, 0 for no limit
+    size_t voices;
+    // Sample frames with both channels at or under this level count as silence
+    float silence;
+} PlanOptions;
+
+extern PlanOptions planopts;
+
+// `frames` stays NULL until loadsamples() decodes the sample. A new instance of
+// a sample with a choke group cuts the ones of the same group that still play.
+// The effects are applied once to the decoded frames, their tail included.
+// Only the floats [lead, active) of the frames are louder than planopts.silence.
+typedef struct {
+    size_t name;
+    char *path;
+    size_t choke;
+    Effects fx;
     Frame *frames;
     size_t count;
+    size_t lead;
+    size_t active;
 } Sample;
 DA(Sample)
 
@@ -42,16 +69,37 @@ typedef struct {
     float value;
 } ParameterChange;
 
+// `sample` is an index into the loaded samples or SYM_NONE for parameter changes.
+// `pitch` is in semitones, `gain` multiplies the sample.
 typedef struct {
-    Sample *sample;
+    size_t sample;
     ParameterChange pc;
     size_t row;
+    float pitch;
+    float gain;
 } AudioObject;
 DA(AudioObject)
 
+// Items [first, first + count) play `times` times in a row starting at `row`,
+// `period` rows apart. Their rows count from the start of the loop, loops
+// [loop + 1, loop + 1 + nested) are inside this one. A `times` of 0 repeats
+// until the end of the enclosing block or loop.
 typedef struct {
-    char name[WORD_MAX_SZ];
+    size_t row;
+    size_t period;
+    size_t times;
+    size_t first;
+    size_t count;
+    size_t nested;
+} Loop;
+DA(Loop)
+
+// Everything the pattern plays goes through the effects as one bus
+typedef struct {
+    size_t name;
     size_t rows;
+    Loops loops;
+    Effects fx;
 
     AudioObject *items;
     size_t count;
@@ -59,22 +107,130 @@ typedef struct {
 } Pattern;
 DA(Pattern)
 
+// Indices into the defined patterns
 typedef struct {
-    Pattern **items;
+    size_t *items;
     size_t count;
     size_t capacity;
 } Sequence;
 
-void addsampleinstance(const char *sample_name, Pattern *pat, size_t row);
-void addbpmchange(float value, Pattern *pat, size_t row);
-void addpattern(Pattern *p, const char *name);
-void addtosequence(const char *pattern_name);
+// One occurrence of a pattern in the sequence. Its sample instances are the
+// events [first, first + count) of the plan, the last of them ends at `end`.
+// `bus` is the effect bus of the pattern or SYM_NONE when it has no effects.
+typedef struct {
+    size_t pattern;
+    size_t start;
+    size_t end;
+    size_t first;
+    size_t count;
+    size_t render;
+    size_t bus;
+} PlanPattern;
+DA(PlanPattern)
+
+// Everything a pattern plays when it starts at `bpm`, tails included. `occurrence`
+// is the first PlanPattern that uses it, `frames` is filled in by the renderer
+// and is silent up to `lead`.
+typedef struct {
+    size_t pattern;
+    float bpm;
+    size_t next;
+    size_t occurrence;
+    size_t uses;
+    Frame *frames;
+    size_t count;
+    size_t lead;
+} PatternRender;
+DA(PatternRender)
 
-size_t saveaudio(const char *filepath);
-void loadsample(const char *path, const char *name);
+// From `row` (counted from the start of the song) on, every row is
+// framesperrow(bpm) long
+typedef struct {
+    size_t row;
+    size_t frame;
+    float bpm;
+} TempoSegment;
+DA(TempoSegment)
+
+// The sequence compiled down to a flat list of sample instances sorted by their
+// absolute start frame. Tempo, choke groups and the voice limit are already
+// baked into it, so the renderers only ever read it. An event with a `cut` fades
+// out from that many frames after its start, over `fade` frames, and its length
+// is shortened to match. The
+// sample is played `step` times faster than recorded, `length` already
+// accounts for it.
+typedef struct {
+    struct {
+        size_t *start;
+        size_t *sample;
+        size_t *length;
+        size_t *cut;
+        size_t *fade;
+        double *step;
+        float *gain;
+        size_t count;
+        size_t capacity;
+    } events;
+    PlanPatterns patterns;
+    PatternRenders renders;
+    TempoSegments tempo;
+    // Longest end - start of a pattern occurrence
+    size_t maxspan;
+    Sample *samples;
+    size_t nsamples;
+    // Effects of the pattern buses and of the master bus
+    Effects *buses;
+    size_t nbuses;
+    Effects masterfx;
+    // Up to the end of the last event or of the effect tails after it
+    size_t total_frames;
+} RenderPlan;
 
-// Not needed yet
-// float sinsound(float i, float freq, float volume, float samplerate);
-// float raisepitch(float base, float semitones);
+typedef enum {
+    FXT_SAMPLE,
+    FXT_PATTERN,
+    FXT_MASTER,
+    FXT_COUNT,
+} EffectTarget;
+
+// Names are symbol ids from intern(), SYM_NONE for an anonymous pattern
+void addsampleinstance(size_t sample_name, Pattern *pat, size_t row, float pitch, float gain);
+void addbpmchange(float value, Pattern *pat, size_t row);
+// Everything added between beginloop() and endloop() belongs to the loop
+size_t beginloop(Pattern *pat, size_t row, size_t times);
+void endloop(Pattern *pat, size_t loop, size_t period);
+// Plays the sample every `period` rows until the end of the block
+void addevery(size_t sample_name, Pattern *pat, size_t row, size_t period, float pitch, float gain);
+// Called when the block (or loop body) whose loops start at `firstloop` ends after `rows` rows
+void endbody(Pattern *pat, size_t firstloop, size_t rows);
+void addpattern(Pattern *p, size_t name);
+void addtosequence(size_t pattern_name);
+// Appends the effect to the chain of sample or pattern `index`, the index is
+// ignored for the master
+void addeffect(EffectTarget target, size_t index, const Effect *fx);
+
+// `choke` is the choke group of the sample, 0 for none
+void loadsample(const char *path, size_t name, size_t choke);
+// Decodes every sample the sequence can reach, in parallel. Returns false when
+// one of them couldn't be decoded, the others are decoded anyway.
+bool loadsamples(void);
+// Needs the samples to be loaded already
+void buildplan(RenderPlan *plan);
+void freeplan(RenderPlan *plan);
+// Frame where the row starts, rows past the end keep the last tempo
+size_t planrowframe(const RenderPlan *plan, size_t row);
+// First occurrence that may still play at `frame`
+size_t planseek(const RenderPlan *plan, size_t frame);
+// Whether the plan has buses with effects, which carry their state from one
+// block to the next and can't be rendered out of order
+bool planeffects(const RenderPlan *plan);
+// What the parsed script defined, for saving a compiled project
+const Samples *projectsamples(void);
+const Patterns *projectpatterns(void);
+const Sequence *projectsequence(void);
+const Effects *projectmasterfx(void);
+// Forgets every sample, pattern and symbol so another script can be parsed.
+// Decoded sample data is kept and reused by the next loadsamples().
+void resetproject(void);
 
 #endif
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "batch.h"
+#include "project.h"
+#include "audio.h"
+#include "render.h"
+#include "mix.h"
+
+typedef struct {
+    RenderPlan plan;
+    char *output;
+} Song;
+
+// Songs [next, count) are planned and wait for a worker. `done` is set once the
+// last script is planned.
+static struct {
+    Song *songs;
+    size_t count;
+    size_t next;
+    bool done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} queue = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+void batch_addscript(Scripts *scripts, const char *path) {
+    char *script = strdup(path);
+    if (script == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    DA_APPEND(scripts, script);
+}
+
+void batch_readlist(const char *path, Scripts *scripts) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Error while opening the file %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, f)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') continue;
+        batch_addscript(scripts, line);
+    }
+    free(line);
+    fclose(f);
+}
+
+void batch_freelist(Scripts *scripts) {
+    for (size_t i = 0; i < scripts->count; ++i) {
+        free(scripts->items[i]);
+    }
+    free(scripts->items);
+    *scripts = (Scripts){0};
+}
+
+static char *outputpath(const char *script) {
+    const char *ext = renderopts.format == OUT_WAV || renderopts.wavheader ? ".wav" : ".raw";
+    const char *dot = strrchr(script, '.');
+    const char *slash = strrchr(script, '/');
+    size_t len = dot != NULL && (slash == NULL || dot > slash) ? (size_t)(dot - script) : strlen(script);
+    char *out = malloc(len + strlen(ext) + 1);
+    if (out == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    memcpy(out, script, len);
+    strcpy(out + len, ext);
+    return out;
+}
+
+static void *songworker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.next == queue.count && !queue.done) {
+            pthread_cond_wait(&queue.cond, &queue.lock);
+        }
+        if (queue.next == queue.count) {
+            pthread_mutex_unlock(&queue.lock);
+            break;
+        }
+        Song s = queue.songs[queue.next++];
+        pthread_cond_broadcast(&queue.cond);
+        pthread_mutex_unlock(&queue.lock);
+        saveaudio(&s.plan, s.output);
+        freeplan(&s.plan);
+        free(s.output);
+    }
+    return NULL;
+}
+
+// Plans the script in the global project and leaves it empty again. Returns
+// false when the script has an error or a sample can't be decoded.
+static bool plansong(const char *script, Song *s) {
+    if (!project_open(script) || !loadsamples()) {
+        resetproject();
+        return false;
+    }
+    buildplan(&s->plan);
+    s->output = outputpath(script);
+    resetproject();
+    return true;
+}
+
+size_t batch(const Scripts *scripts, size_t jobs) {
+    queue.songs = calloc(scripts->count + 1, sizeof(Song));
+    if (queue.songs == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    queue.count = 0;
+    queue.next = 0;
+    queue.done = false;
+
+    // One thread per song, the songs are what is split between the cores
+    renderopts.jobs = 1;
+    mix_init();
+    jobs = jobs < scripts->count ? jobs : scripts->count;
+    pthread_t *threads = calloc(jobs + 1, sizeof(pthread_t));
+    if (threads == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    size_t started = 0;
+    for (size_t i = 0; i < jobs; ++i) {
+        if (pthread_create(&threads[i], NULL, songworker, NULL) != 0) break;
+        started = i + 1;
+    }
+
+    // Parsing uses the global project, so the scripts take turns on this
+    // thread. Each plan is self-contained and goes to the workers right away.
+    size_t failed = 0;
+    for (size_t i = 0; i < scripts->count; ++i) {
+        Song s = {0};
+        if (!plansong(scripts->items[i], &s)) {
+            fprintf(stderr, "Skipping %s\n", scripts->items[i]);
+            failed++;
+            continue;
+        }
+        pthread_mutex_lock(&queue.lock);
+        // Plans hold on to their samples, don't get far ahead of the renders
+        while (started > 0 && queue.count - queue.next >= started) {
+            pthread_cond_wait(&queue.cond, &queue.lock);
+        }
+        queue.songs[queue.count++] = s;
+        pthread_cond_broadcast(&queue.cond);
+        pthread_mutex_unlock(&queue.lock);
+    }
+    pthread_mutex_lock(&queue.lock);
+    queue.done = true;
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+
+    if (started == 0) {
+        songworker(NULL);
+    }
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(queue.songs);
+    return failed;
+}
@@ -0,0 +1,24 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <stdlib.h>
+
+typedef struct {
+    char **items;
+    size_t count;
+    size_t capacity;
+} Scripts;
+
+void batch_addscript(Scripts *scripts, const char *path);
+// Adds the scripts listed in the file, one path per line. Empty lines and lines
+// starting with # are skipped.
+void batch_readlist(const char *path, Scripts *scripts);
+void batch_freelist(Scripts *scripts);
+// Parses the scripts one after another and renders each one as soon as it is
+// parsed, `jobs` of them at a time. Every script is written next to itself with
+// its extension replaced by .wav (.raw for the raw formats). A sample file used
+// by several scripts is only decoded once. A script with an error is reported
+// and skipped, returns how many were.
+size_t batch(const Scripts *scripts, size_t jobs);
+
+#endif
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "fx.h"
+#include "audio.h"
+#include "mix.h"
+
+// Longest delay line and longest tail that gets added to a sample
+#define FX_MAX_DELAY 10.0f
+#define FX_MAX_TAIL (30 * SAMPLE_RATE * 2)
+// Echoes quieter than this are left out of the tail
+#define FX_TAIL_FLOOR 1e-4
+
+static const struct {
+    const char *name;
+    size_t required;
+    float defaults[FX_MAX_PARAMS];
+} effects[FX_COUNT] = {
+    [FX_GAIN] = { "gain", 1, {0} },
+    [FX_PAN] = { "pan", 1, {0} },
+    [FX_LOWPASS] = { "lowpass", 1, { 0, 0.707f } },
+    [FX_HIGHPASS] = { "highpass", 1, { 0, 0.707f } },
+    [FX_BANDPASS] = { "bandpass", 1, { 0, 0.707f } },
+    [FX_DELAY] = { "delay", 1, { 0, 0.3f, 0.5f } },
+    [FX_LIMIT] = { "limit", 0, { 1, 0.1f } },
+};
+
+EffectType fx_lookup(const char *name, size_t len) {
+    for (size_t i = 0; i < FX_COUNT; ++i) {
+        if (strlen(effects[i].name) == len && !memcmp(effects[i].name, name, len)) return i;
+    }
+    return FX_COUNT;
+}
+
+const char *fx_name(EffectType type) {
+    return effects[type].name;
+}
+
+const char *fx_check(Effect *fx, size_t given) {
+    if (given < effects[fx->type].required) return "not enough arguments";
+    for (size_t i = given; i < FX_MAX_PARAMS; ++i) {
+        fx->params[i] = effects[fx->type].defaults[i];
+    }
+    float *p = fx->params;
+    for (size_t i = 0; i < FX_MAX_PARAMS; ++i) {
+        if (!isfinite(p[i])) return "arguments have to be finite";
+    }
+    switch (fx->type) {
+        case FX_PAN:
+            if (p[0] < -1 || p[0] > 1) return "pan goes from -1 to 1";
+            break;
+        case FX_LOWPASS:
+        case FX_HIGHPASS:
+        case FX_BANDPASS:
+            if (p[0] <= 0 || p[0] >= SAMPLE_RATE / 2) return "frequency has to be between 0 and half the sample rate";
+            if (p[1] <= 0) return "q has to be above 0";
+            break;
+        case FX_DELAY:
+            if (p[0] <= 0 || p[0] > FX_MAX_DELAY) return "delay time has to be above 0 and at most 10 seconds";
+            if (p[1] < 0 || p[1] >= 1) return "feedback has to be at least 0 and below 1";
+            break;
+        case FX_LIMIT:
+            if (p[0] <= 0) return "ceiling has to be above 0";
+            if (p[1] <= 0) return "release has to be above 0";
+            break;
+        default:
+            break;
+    }
+    return NULL;
+}
+
+static size_t delayfloats(float seconds) {
+    size_t frames = lrintf(seconds * SAMPLE_RATE);
+    return (frames > 0 ? frames : 1) * 2;
+}
+
+size_t fx_tail(const Effect *fx, size_t count) {
+    size_t tail = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (fx[i].type != FX_DELAY) continue;
+        float feedback = fx[i].params[1];
+        size_t echoes = feedback > 0 ? ceil(log(FX_TAIL_FLOOR) / log(feedback)) : 1;
+        tail += echoes * delayfloats(fx[i].params[0]);
+        if (tail >= FX_MAX_TAIL) return FX_MAX_TAIL;
+    }
+    return tail;
+}
+
+// FNV-1a over the fields, the padding of Effect is left out
+uint64_t fx_signature(const Effect *fx, size_t count) {
+    if (count == 0) return 0;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t words[FX_MAX_PARAMS + 1] = { fx[i].type };
+        memcpy(words + 1, fx[i].params, sizeof(fx[i].params));
+        const unsigned char *p = (const unsigned char*)words;
+        for (size_t b = 0; b < sizeof(words); ++b) {
+            h = (h ^ p[b]) * 1099511628211ULL;
+        }
+    }
+    return h | 1;
+}
+
+// Coefficients from the Audio EQ Cookbook, normalized by a0
+static void biquadcoef(EffectType type, float hz, float q, float coef[5]) {
+    double w0 = 2 * M_PI * hz / SAMPLE_RATE;
+    double cosw = cos(w0), alpha = sin(w0) / (2 * q);
+    double b0, b1, b2;
+    switch (type) {
+        case FX_LOWPASS:
+            b0 = b2 = (1 - cosw) / 2;
+            b1 = 1 - cosw;
+            break;
+        case FX_HIGHPASS:
+            b0 = b2 = (1 + cosw) / 2;
+            b1 = -(1 + cosw);
+            break;
+        default:
+            b0 = alpha;
+            b1 = 0;
+            b2 = -alpha;
+            break;
+    }
+    double a0 = 1 + alpha;
+    coef[0] = b0 / a0;
+    coef[1] = b1 / a0;
+    coef[2] = b2 / a0;
+    coef[3] = -2 * cosw / a0;
+    coef[4] = (1 - alpha) / a0;
+}
+
+void fx_init(FxChain *chain, const Effect *fx, size_t count, float level) {
+    chain->units = calloc(count + 1, sizeof(FxUnit));
+    chain->count = count;
+    if (chain->units == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        FxUnit *u = &chain->units[i];
+        const float *p = fx[i].params;
+        u->type = fx[i].type;
+        switch (u->type) {
+            case FX_GAIN:
+                u->gain[0] = u->gain[1] = p[0];
+                break;
+            case FX_PAN:
+                // Balance: the side it goes away from gets quieter, the middle stays as it is
+                u->gain[0] = p[0] > 0 ? 1 - p[0] : 1;
+                u->gain[1] = p[0] < 0 ? 1 + p[0] : 1;
+                break;
+            case FX_LOWPASS:
+            case FX_HIGHPASS:
+            case FX_BANDPASS:
+                biquadcoef(u->type, p[0], p[1], u->coef);
+                break;
+            case FX_DELAY:
+                u->length = delayfloats(p[0]);
+                u->ring = calloc(u->length, sizeof(float));
+                if (u->ring == NULL) {
+                    fprintf(stderr, "Error: out of memory\n");
+                    exit(1);
+                }
+                u->gain[0] = p[1];
+                u->gain[1] = p[2];
+                break;
+            case FX_LIMIT:
+                u->gain[0] = p[0] / level;
+                u->gain[1] = 1 - exp(-1 / (p[1] * SAMPLE_RATE));
+                u->env = 1;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void gain(FxUnit *u, float *buf, size_t n) {
+    for (size_t i = 0; i + 2 <= n; i += 2) {
+        buf[i] *= u->gain[0];
+        buf[i + 1] *= u->gain[1];
+    }
+}
+
+// Feedback delay line, both channels share it interleaved
+static void delay(FxUnit *u, float *buf, size_t n) {
+    float feedback = u->gain[0], wet = u->gain[1];
+    for (size_t i = 0; i < n; ++i) {
+        float d = u->ring[u->pos];
+        u->ring[u->pos] = (buf[i] + d * feedback + 1e-18f) - 1e-18f;
+        buf[i] += d * wet;
+        if (++u->pos == u->length) u->pos = 0;
+    }
+}
+
+// Peak limiter without lookahead: the gain drops right away to keep a frame
+// under the ceiling and comes back up at the release rate
+static void limit(FxUnit *u, float *buf, size_t n) {
+    float ceiling = u->gain[0], release = u->gain[1];
+    for (size_t i = 0; i + 2 <= n; i += 2) {
+        float l = fabsf(buf[i]), r = fabsf(buf[i + 1]);
+        float peak = l > r ? l : r;
+        u->env += (1 - u->env) * release;
+        if (peak * u->env > ceiling) u->env = ceiling / peak;
+        buf[i] *= u->env;
+        buf[i + 1] *= u->env;
+    }
+}
+
+void fx_process(FxChain *chain, float *buf, size_t n) {
+    for (size_t i = 0; i < chain->count; ++i) {
+        FxUnit *u = &chain->units[i];
+        switch (u->type) {
+            case FX_GAIN:
+            case FX_PAN:
+                gain(u, buf, n);
+                break;
+            case FX_LOWPASS:
+            case FX_HIGHPASS:
+            case FX_BANDPASS:
+                mix_biquad(buf, n, u->coef, u->state);
+                break;
+            case FX_DELAY:
+                delay(u, buf, n);
+                break;
+            case FX_LIMIT:
+                limit(u, buf, n);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void fx_free(FxChain *chain) {
+    for (size_t i = 0; i < chain->count; ++i) {
+        free(chain->units[i].ring);
+    }
+    free(chain->units);
+    *chain = (FxChain){0};
+}
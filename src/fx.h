@@ -0,0 +1,72 @@
+#ifndef FX_H_
+#define FX_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "util.h"
+
+typedef enum {
+    FX_GAIN,
+    FX_PAN,
+    FX_LOWPASS,
+    FX_HIGHPASS,
+    FX_BANDPASS,
+    FX_DELAY,
+    FX_LIMIT,
+    FX_COUNT,
+} EffectType;
+
+#define FX_MAX_PARAMS 3
+
+// An effect the way the script wrote it:
+//   gain(target, gain)
+//   pan(target, -1 (left) to 1 (right))
+//   lowpass/highpass/bandpass(target, hz, q = 0.707)
+//   delay(target, seconds, feedback = 0.3, wet = 0.5)
+//   limit(target, ceiling = 1, release in seconds = 0.1)
+typedef struct {
+    EffectType type;
+    float params[FX_MAX_PARAMS];
+} Effect;
+DA(Effect)
+
+// One effect of a chain with its coefficients and state
+typedef struct {
+    EffectType type;
+    float gain[2];
+    float coef[5];
+    float state[4];
+    float *ring;
+    size_t length;
+    size_t pos;
+    float env;
+} FxUnit;
+
+// Everything is allocated by fx_init(), fx_process() only touches the buffer and
+// the state, so it can run on the audio path
+typedef struct {
+    FxUnit *units;
+    size_t count;
+} FxChain;
+
+// FX_COUNT if there is no effect with that name
+EffectType fx_lookup(const char *name, size_t len);
+const char *fx_name(EffectType type);
+// Fills in the parameters after the first `given` ones and checks them all.
+// Returns what is wrong with them or NULL.
+const char *fx_check(Effect *fx, size_t given);
+// How many floats the effects keep ringing after their input ends
+size_t fx_tail(const Effect *fx, size_t count);
+// Hash of the types and parameters, 0 only when there are no effects
+uint64_t fx_signature(const Effect *fx, size_t count);
+
+// The output of the chain gets multiplied by `level` later on, limiter ceilings
+// are meant after that
+void fx_init(FxChain *chain, const Effect *fx, size_t count, float level);
+// Runs the stereo buf (n floats) through the chain. Every effect works frame by
+// frame, so the result doesn't depend on how the buffer is split up.
+void fx_process(FxChain *chain, float *buf, size_t n);
+void fx_free(FxChain *chain);
+
+#endif
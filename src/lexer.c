@@ -2,14 +2,21 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "lexer.h"
+#include "stats.h"
 
 static char *token_type_names[TT_COUNT] = {
     [TT_EOF] = "end of file",
     [TT_EOL] = "newline",
     [TT_INVALID] = "invalid token",
     [TT_WORD] = "word",
+    [TT_NUM] = "number",
+    [TT_DECIMAL] = "decimal number",
     [TT_STRLIT] = "string literal",
     [TT_EQ] = "equal sign",
     [TT_OB] = "opening bracket",
@@ -31,68 +38,106 @@ TokenType literaltokens[256] = {
     ['!'] = TT_COMMA,
 };
 
-char* printablevalue(const Token *t) {
+bool sv_eq(StrView sv, const char *str) {
+    return strlen(str) == sv.len && !memcmp(sv.data, str, sv.len);
+}
+
+const char* printablevalue(const Token *t) {
+    static char value[STR_MAX_SZ + 3];
     if (t->type == TT_EOF) {
         return "<End of file>";
     } else if (t->type == TT_EOL) {
         return "<End of line>";
-    } else if (t->type == TT_STRLIT) {
-        char *value = (char*)malloc(strlen(t->value.asStr) + 3);
-        value[0] = '\0';
-        strcat(value, "\"");
-        strcat(value, t->value.asStr);
-        strcat(value, "\"");
-        return value;
     } else if (t->type == TT_NUM) {
-        int l = snprintf(NULL, 0, "%zu", t->value.asNum);
-        assert(l >= 0);
-        char *str = calloc(l + 1, sizeof(char));
-        sprintf(str, "%zu", t->value.asNum);
-        return str;
+        snprintf(value, sizeof(value), "%zu", t->value.asNum);
+        return value;
+    } else if (t->type == TT_DECIMAL) {
+        snprintf(value, sizeof(value), "%g", t->value.asDecimal);
+        return value;
     }
-    return t->value.asStr;
+    StrView sv = t->value.asStr;
+    if (t->type == TT_STRLIT) {
+        snprintf(value, sizeof(value), "\"%.*s\"", (int)sv.len, sv.data);
+    } else {
+        snprintf(value, sizeof(value), "%.*s", (int)sv.len, sv.data);
+    }
+    return value;
+}
+
+jmp_buf *lex_onerror;
+
+void lex_fail(void) {
+    if (lex_onerror != NULL) {
+        longjmp(*lex_onerror, 1);
+    }
+    exit(1);
 }
 
 void tokenexception(const Token *t) {
     fprintf(stderr, "Error: unexpected token %s\n", printablevalue(t));
-    exit(1);
+    lex_fail();
 }
 
-Lexer lex_init(const char *filepath, Buffer *buf) {
-    Lexer l = { .buf = buf };
+// Maps the whole file so tokens can point straight into it. Anything that can't
+// be mapped (pipes, empty files) is read into memory instead.
+Lexer lex_init(const char *filepath, Buffer *buf, Arena *arena) {
+    Lexer l = { .buf = buf, .arena = arena };
 
-    FILE *file = fopen(filepath, "r");
-    if (file == NULL) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
         fprintf(stderr, "Error while opening the file %s: %s\n", filepath, strerror(errno));
-        exit(1);
+        lex_fail();
     }
-    l.file = file;
+    buf->pos = 0;
 
-    l.buf = buf;
-    lex_readfile(&l);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            buf->data = data;
+            buf->size = st.st_size;
+            l.mapped = true;
+            close(fd);
+            return l;
+        }
+    }
 
+    size_t capacity = 4096, size = 0;
+    char *data = arena_alloc(arena, capacity);
+    ssize_t n;
+    while ((n = read(fd, data + size, capacity - size)) != 0) {
+        if (n < 0) {
+            fprintf(stderr, "Error while reading from the file: %s\n", strerror(errno));
+            lex_fail();
+        }
+        size += n;
+        if (size == capacity) {
+            data = arena_realloc(arena, data, capacity, capacity * 2);
+            capacity *= 2;
+        }
+    }
+    close(fd);
+    buf->data = data;
+    buf->size = size;
     return l;
 }
 
-void lex_readfile(const Lexer *l) {
-    size_t bytes_read = fread(l->buf->data, 1, BUF_SZ, l->file);
-    l->buf->pos = 0;
-    l->buf->size = bytes_read;
-    if (bytes_read < BUF_SZ && !feof(l->file)) {
-        fprintf(stderr, "Error while reading from the file: %s\n", strerror(errno));
-        exit(1);
+void lex_close(const Lexer *l) {
+    if (l->mapped) {
+        munmap((void*)l->buf->data, l->buf->size);
     }
+    l->buf->data = NULL;
+    l->buf->size = 0;
 }
 
 char lex_peek(const Lexer *l) {
+    if (BUF_EOF(l->buf)) return '\0';
     return l->buf->data[l->buf->pos];
 }
 
 void lex_incbuf(const Lexer *l) {
     l->buf->pos++;
-    if (l->buf->pos >= BUF_SZ) {
-        lex_readfile(l);
-    }
 }
 
 char lex_getc(const Lexer *l) {
@@ -115,35 +160,43 @@ bool lex_skipws(const Lexer *l) {
     return false;
 }
 
-bool lex_readword(const Lexer *l, char word[WORD_MAX_SZ]) {
+bool lex_readword(const Lexer *l, StrView *word) {
     size_t j = 0;
+    word->data = l->buf->data + l->buf->pos;
     char c = lex_peek(l);
     while((isalnum(c) || c == '_') && !BUF_EOF(l->buf)) {
-        word[j++] = c;
+        j++;
         if (j >= WORD_MAX_SZ) {
-            fprintf(stderr, "Error: word is too big for a keyword: %s\n", word);
-            exit(1);
+            fprintf(stderr, "Error: word is too big for a keyword: %.*s\n", (int)j, word->data);
+            lex_fail();
         }
         c = lex_nextc(l);
     }
     if (j == 0) {
-        word[0] = c;
+        word->len = 1;
         return false;
     }
+    word->len = j;
     return true;
 }
-bool lex_readstrlit(const Lexer *l, char str[STR_MAX_SZ]) {
+bool lex_readstrlit(const Lexer *l, StrView *str) {
     size_t j = 0;
+    str->data = l->buf->data + l->buf->pos;
+    str->len = 0;
     char c = lex_getc(l);
     while(c != '"') {
-        str[j++] = c;
+        j++;
         if (j >= STR_MAX_SZ) {
             fprintf(stderr, "Error: word is too big for a keyword\n");
-            exit(1);
+            lex_fail();
+        }
+        if (BUF_EOF(l->buf)) {
+            str->len = j;
+            return false;
         }
-        if (BUF_EOF(l->buf)) return false;
         c = lex_getc(l);
     }
+    str->len = j;
     return true;
 }
 
@@ -154,7 +207,7 @@ size_t lex_readnum(const Lexer *l) {
         uint8_t digit = c-48;
         if (num > (SIZE_MAX - digit) / 10) {
             fprintf(stderr, "Error: too big of a number\n");
-            exit(1);
+            lex_fail();
         }
         num *= 10;
         num += digit;
@@ -163,56 +216,102 @@ size_t lex_readnum(const Lexer *l) {
     return num;
 }
 
-Token lex_next(const Lexer *l) {
+// Numbers like 12, -3 or 0.25
+static Token lex_number(const Lexer *l) {
+    Token t = { .type = TT_NUM };
+    const char *start = l->buf->data + l->buf->pos;
+    bool negative = lex_peek(l) == '-';
+    if (negative) lex_incbuf(l);
+    size_t from = l->buf->pos;
+    size_t num = lex_readnum(l);
+    bool digits = l->buf->pos > from;
+    if (lex_peek(l) != '.') {
+        if (!digits) {
+            t.type = TT_INVALID;
+            t.value.asStr = (StrView){ start, l->buf->data + l->buf->pos - start };
+        } else if (negative) {
+            t.type = TT_DECIMAL;
+            t.value.asDecimal = -(double)num;
+        } else {
+            t.value.asNum = num;
+        }
+        return t;
+    }
+    lex_incbuf(l);
+    double frac = 0, scale = 1;
+    while (isdigit(lex_peek(l))) {
+        scale /= 10;
+        frac += (lex_peek(l) - '0') * scale;
+        digits = true;
+        lex_incbuf(l);
+    }
+    if (!digits) {
+        t.type = TT_INVALID;
+        t.value.asStr = (StrView){ start, l->buf->data + l->buf->pos - start };
+        return t;
+    }
+    t.type = TT_DECIMAL;
+    t.value.asDecimal = (negative ? -1 : 1) * (num + frac);
+    return t;
+}
+
+static Token lex_token(const Lexer *l) {
     Token t = {0};
     if (lex_skipws(l)) return t;
     char c = lex_peek(l);
     TokenType lit_tt = literaltokens[(uint8_t) c];
     if (lit_tt != 0) {
-        t.value.asStr = (char*)calloc(2, sizeof(char));
-        t.value.asStr[0] = c;
+        t.value.asStr.data = l->buf->data + l->buf->pos;
+        t.value.asStr.len = 1;
         t.type = lit_tt;
 
         lex_incbuf(l);
         // printf("%s, %s\n", token_type_names[t.type], printablevalue(&t));
         return t;
     }
-    if (isdigit(c)) {
-        size_t num = lex_readnum(l);
-        t.type = TT_NUM;
-        t.value.asNum = num;
-        return t;
+    if (isdigit(c) || c == '-' || c == '.') {
+        return lex_number(l);
     }
     switch(c) {
         case '"':
             lex_getc(l);
-            char strlit[STR_MAX_SZ] = {0};
-            if (lex_readstrlit(l, strlit)) {
+            if (lex_readstrlit(l, &t.value.asStr)) {
                 t.type = TT_STRLIT;
             } else {
                 t.type = TT_INVALID;
             }
-            t.value.asStr = strdup(strlit);
             break;
         default:
-            char word[WORD_MAX_SZ] = {0};
-            if (lex_readword(l, word)) {
+            if (lex_readword(l, &t.value.asStr)) {
                 t.type = TT_WORD;
             } else {
                 t.type = TT_INVALID;
                 lex_incbuf(l);
             }
-            t.value.asStr = strdup(word);
             break;
     }
     // printf("%s, %s\n", token_type_names[t.type], printablevalue(&t));
     return t;
 }
 
+Token lex_next(const Lexer *l) {
+    return lex_token(l);
+}
+
+void lex_stats(const Lexer *l) {
+    size_t pos = l->buf->pos;
+    uint64_t tokens = 1;
+    uint64_t start = stats_begin();
+    while (lex_token(l).type != TT_EOF) tokens++;
+    stats_end(PH_LEX, start);
+    stats_count(CT_TOKENS, tokens);
+    l->buf->pos = pos;
+}
+
 void lex_expect(const Lexer *l, TokenType t) {
     Token got = lex_next(l);
     if (got.type != t) {
         fprintf(stderr, "Error: expected %s but got %s\n", token_type_names[t], printablevalue(&got));
-        exit(1);
+        lex_fail();
     }
 }
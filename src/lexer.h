@@ -6,12 +6,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <setjmp.h>
+
+#include "arena.h"
 
 #define WORD_MAX_SZ 64
 #define STR_MAX_SZ 256
 
-#define BUF_SZ 1024
-
 #define BUF_EOF(buf) ((buf)->pos >= (buf)->size)
 #define ARRLEN(arr) sizeof(arr)/sizeof(arr[0])
 
@@ -21,6 +22,7 @@ typedef enum {
     TT_INVALID,
     TT_WORD,
     TT_NUM,
+    TT_DECIMAL,
     TT_STRLIT,
     TT_EQ,
     TT_OB,
@@ -32,9 +34,17 @@ typedef enum {
     TT_COUNT,
 } TokenType;
 
+// Points into the lexed source, not NUL terminated
+typedef struct {
+    const char *data;
+    size_t len;
+} StrView;
+
+// TT_NUM is an unsigned integer, anything with a sign or a fraction is a TT_DECIMAL
 typedef union {
-    char *asStr;
+    StrView asStr;
     size_t asNum;
+    double asDecimal;
 } TokenValue;
 
 typedef struct {
@@ -42,32 +52,48 @@ typedef struct {
     TokenValue value;
 } Token;
 
+// The whole source file, mmapped when possible
 typedef struct {
-    char *data;
+    const char *data;
 
     size_t size;
     size_t pos;
 } Buffer;
 
+// `arena` holds everything allocated while parsing this file
 typedef struct {
-    FILE *file;
+    bool mapped;
     Buffer *buf;
+    Arena *arena;
 } Lexer;
 
-char* printablevalue(const Token *t);
-void tokenexception(const Token *t);
+// Where errors in the script go while parse() runs, NULL otherwise
+extern jmp_buf *lex_onerror;
+// Gives up on the script once the error has been printed: back to parse(), or
+// exit(1) when nothing is being parsed
+_Noreturn void lex_fail(void);
+
+// The result is only valid until the next call
+const char* printablevalue(const Token *t);
+_Noreturn void tokenexception(const Token *t);
+
+bool sv_eq(StrView sv, const char *str);
 
-Lexer lex_init(const char *filepath, Buffer *buf);
-void lex_readfile(const Lexer *l);
+// Tokens point into the buffer, so they are only valid until lex_close()
+Lexer lex_init(const char *filepath, Buffer *buf, Arena *arena);
+void lex_close(const Lexer *l);
 char lex_peek(const Lexer *l);
 void lex_incbuf(const Lexer *l);
 char lex_getc(const Lexer *l);
 char lex_nextc(const Lexer *l);
 bool lex_skipws(const Lexer *l);
-bool lex_readword(const Lexer *l, char word[WORD_MAX_SZ]);
-bool lex_readstrlit(const Lexer *l, char str[STR_MAX_SZ]);
+bool lex_readword(const Lexer *l, StrView *word);
+bool lex_readstrlit(const Lexer *l, StrView *str);
 size_t lex_readnum(const Lexer *l);
 Token lex_next(const Lexer *l);
+// Lexes the rest of the buffer on its own for --stats, then goes back. Timing
+// the tokens one by one while parsing would mostly measure the clock.
+void lex_stats(const Lexer *l);
 void lex_expect(const Lexer *l, TokenType t);
 
 #endif
@@ -1,13 +1,200 @@
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
 #include "parser.h"
+#include "project.h"
+#include "batch.h"
 #include "audio.h"
+#include "render.h"
+#include "watch.h"
+#include "stats.h"
+
+#define ROWS_PER_BAR 16
+
+// Where --from and --to point: a number of rows (12r), bars (12b or just 12) or
+// seconds (12s) from the start of the song
+typedef struct {
+    bool set;
+    double value;
+    char unit;
+} Position;
+
+static Position parseposition(const char *arg) {
+    char *end;
+    Position p = { .set = true, .value = strtod(arg, &end), .unit = *end ? *end : 'b' };
+    if (end == arg || p.value < 0 || (*end && end[1] != '\0') || !strchr("rbs", p.unit)) {
+        fprintf(stderr, "Error: invalid position: %s\n", arg);
+        exit(1);
+    }
+    return p;
+}
+
+static size_t positionframe(const RenderPlan *plan, Position p) {
+    switch (p.unit) {
+        case 'r': return planrowframe(plan, p.value);
+        case 'b': return planrowframe(plan, p.value * ROWS_PER_BAR);
+        default: return (size_t)(p.value * SAMPLE_RATE) * 2;
+    }
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-j N] [-o <file>|-] [-f wav|s16le|f32le] [--wav-header] [--voices N] [--silence <dB>] [--interp cubic|linear] [--compile] [--batch <list.txt>] [--stems] [--from <pos>] [--to <pos>] [--watch] [--stats] [--trace <file.json>] <file.trang>...\n", program);
+    exit(1);
+}
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
+    Scripts scripts = {0};
+    char *output = NULL;
+    bool batching = false;
+    bool watching = false;
+    bool compile = false;
+    bool jobsset = false;
+    bool stems = false;
+    Position from = {0}, to = {0};
+    char *trace = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-j")) {
+            if (i + 1 >= argc) usage(argv[0]);
+            char *end;
+            long jobs = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || jobs < 1) {
+                fprintf(stderr, "Error: invalid number of jobs: %s\n", argv[i]);
+                exit(1);
+            }
+            renderopts.jobs = jobs;
+            jobsset = true;
+        } else if (!strcmp(argv[i], "--batch")) {
+            if (i + 1 >= argc) usage(argv[0]);
+            batch_readlist(argv[++i], &scripts);
+            batching = true;
+        } else if (!strcmp(argv[i], "-o")) {
+            if (i + 1 >= argc) usage(argv[0]);
+            output = argv[++i];
+        } else if (!strcmp(argv[i], "-f")) {
+            if (i + 1 >= argc) usage(argv[0]);
+            char *format = argv[++i];
+            if (!strcmp(format, "wav")) renderopts.format = OUT_WAV;
+            else if (!strcmp(format, "s16le")) renderopts.format = OUT_S16LE;
+            else if (!strcmp(format, "f32le")) renderopts.format = OUT_F32LE;
+            else {
+                fprintf(stderr, "Error: unknown output format: %s\n", format);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--voices")) {
+            if (i + 1 >= argc) usage(argv[0]);
+            char *end;
+            long voices = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || voices < 0) {
+                fprintf(stderr, "Error: invalid number of voices: %s\n", argv[i]);
+                exit(1);
+            }
+            planopts.voices = voices;
+        } else if (!strcmp(argv[i], "--silence")) {
+            if (i + 1 >= argc) usage(argv[0]);
+            char *end;
+            double db = strtod(argv[++i], &end);
+            if (end == argv[i] || *end != '\0' || db > 0) {
+                fprintf(stderr, "Error: invalid silence threshold: %s\n", argv[i]);
+                exit(1);
+            }
+            planopts.silence = pow(10, db / 20);
+        } else if (!strcmp(argv[i], "--interp")) {
+            if (i + 1 >= argc) usage(argv[0]);
+            char *interp = argv[++i];
+            if (!strcmp(interp, "cubic")) renderopts.interp = INTERP_CUBIC;
+            else if (!strcmp(interp, "linear")) renderopts.interp = INTERP_LINEAR;
+            else {
+                fprintf(stderr, "Error: unknown interpolation: %s\n", interp);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--wav-header")) {
+            renderopts.wavheader = true;
+        } else if (!strcmp(argv[i], "--from")) {
+            if (i + 1 >= argc) usage(argv[0]);
+            from = parseposition(argv[++i]);
+        } else if (!strcmp(argv[i], "--to")) {
+            if (i + 1 >= argc) usage(argv[0]);
+            to = parseposition(argv[++i]);
+        } else if (!strcmp(argv[i], "--stems")) {
+            stems = true;
+        } else if (!strcmp(argv[i], "--compile")) {
+            compile = true;
+        } else if (!strcmp(argv[i], "--watch")) {
+            watching = true;
+        } else if (!strcmp(argv[i], "--stats")) {
+            stats_enable(false);
+        } else if (!strcmp(argv[i], "--trace")) {
+            if (i + 1 >= argc) usage(argv[0]);
+            trace = argv[++i];
+            stats_enable(true);
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            usage(argv[0]);
+        } else {
+            batch_addscript(&scripts, argv[i]);
+        }
+    }
+    if (scripts.count == 0 && !batching) {
         fprintf(stderr, "Error: expected 1 command line arguments but got none\n");
         exit(1);
     }
-    char *filepath = argv[1];
-    parse(filepath);
-    saveaudio("out.wav");
+    if (compile) {
+        for (size_t i = 0; i < scripts.count; ++i) {
+            project_compile(scripts.items[i]);
+            resetproject();
+        }
+        batch_freelist(&scripts);
+        return 0;
+    }
+    if (batching || scripts.count > 1) {
+        if (output != NULL || watching || stems || from.set || to.set) {
+            fprintf(stderr, "Error: -o, --watch, --stems, --from and --to only work with a single script\n");
+            exit(1);
+        }
+        // Without -j every core gets a song
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t failed = batch(&scripts, jobsset ? renderopts.jobs : cpus > 0 ? (size_t)cpus : 1);
+        batch_freelist(&scripts);
+        stats_print(stderr);
+        if (trace != NULL) {
+            stats_writetrace(trace);
+        }
+        return failed > 0;
+    }
+    const char *filepath = scripts.items[0];
+    output = output != NULL ? output : "out.wav";
+    if (watching) {
+        if (stems || from.set || to.set) {
+            fprintf(stderr, "Error: --stems, --from and --to can't be used with --watch\n");
+            exit(1);
+        }
+        watch(filepath, output);
+    }
+    if (!project_open(filepath) || !loadsamples()) {
+        exit(1);
+    }
+    RenderPlan plan;
+    buildplan(&plan);
+    renderopts.from = from.set ? positionframe(&plan, from) : 0;
+    renderopts.to = to.set ? positionframe(&plan, to) : 0;
+    if (to.set && renderopts.to <= renderopts.from) {
+        fprintf(stderr, "Error: --to has to be after --from\n");
+        exit(1);
+    }
+    if (from.set && renderopts.from >= plan.total_frames) {
+        fprintf(stderr, "Error: --from is past the end of the song\n");
+        exit(1);
+    }
+    if (stems) {
+        savestems(&plan, output);
+    } else {
+        saveaudio(&plan, output);
+    }
+    freeplan(&plan);
+    batch_freelist(&scripts);
+    stats_print(stderr);
+    if (trace != NULL) {
+        stats_writetrace(trace);
+    }
     return 0;
 }
@@ -0,0 +1,330 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MIX_X86
+#include <immintrin.h>
+#endif
+
+#include "mix.h"
+
+typedef void (*MixAddFn)(float *dst, const float *src, size_t n, float gain);
+typedef void (*MixMasterFn)(float *buf, size_t n, float gain);
+typedef float (*MixDotFn)(const float *a, const float *b, size_t n);
+typedef void (*MixPitchFn)(float *out, const float *src, size_t frames, size_t first, size_t n, double step, Interp interp);
+typedef void (*MixBiquadFn)(float *buf, size_t n, const float coef[5], float state[4]);
+
+// Adding and taking this away again rounds denormals to 0, a filter ringing out
+// in silence would otherwise slow to a crawl
+#define MIX_DENORMAL 1e-18f
+
+// The dot products keep 8 running sums (one per lane of an AVX register) and
+// add them up the same way at the end
+static float dotreduce(const float acc[8], const float *a, const float *b, size_t i, size_t n) {
+    float sum = ((acc[0] + acc[4]) + (acc[2] + acc[6])) + ((acc[1] + acc[5]) + (acc[3] + acc[7]));
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static float mix_dot_scalar(const float *a, const float *b, size_t n) {
+    float acc[8] = {0};
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int k = 0; k < 8; ++k) {
+            acc[k] += a[i + k] * b[i + k];
+        }
+    }
+    return dotreduce(acc, a, b, i, n);
+}
+
+static void mix_add_scalar(float *dst, const float *src, size_t n, float gain) {
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] += src[i] * gain;
+    }
+}
+
+static float pitchtap(const float *src, size_t frames, size_t i, size_t c) {
+    return i < frames ? src[i * 2 + c] : 0.0f;
+}
+
+// Catmull-Rom spline through the 4 frames around the position
+static float cubic(float sm1, float s0, float s1, float s2, float f) {
+    float c1 = 0.5f * (s1 - sm1);
+    float c2 = sm1 - 2.5f * s0 + 2.0f * s1 - 0.5f * s2;
+    float c3 = 0.5f * (s2 - sm1) + 1.5f * (s0 - s1);
+    return ((c3 * f + c2) * f + c1) * f + s0;
+}
+
+// Positions are computed from the frame number, never accumulated, so a voice
+// comes out the same however the timeline is split
+static void mix_pitch_scalar(float *out, const float *src, size_t frames, size_t first, size_t n, double step, Interp interp) {
+    for (size_t j = 0; j < n; ++j) {
+        size_t g = first + j, c = g & 1;
+        double p = (double)(g / 2) * step;
+        double fl = floor(p);
+        size_t i = (size_t)fl;
+        float f = (float)(p - fl);
+        float s0 = pitchtap(src, frames, i, c);
+        float s1 = pitchtap(src, frames, i + 1, c);
+        if (interp == INTERP_LINEAR) {
+            out[j] = s0 + f * (s1 - s0);
+        } else {
+            // i - 1 wraps around to a huge index for the first frame
+            out[j] = cubic(pitchtap(src, frames, i - 1, c), s0, s1, pitchtap(src, frames, i + 2, c), f);
+        }
+    }
+}
+
+// Past the knee the level grows by k * d / (k + d), which starts with the same
+// slope as the signal and flattens out towards 1.
+static void mix_master_scalar(float *buf, size_t n, float gain) {
+    const float k = 1.0f - MIX_KNEE;
+    for (size_t i = 0; i < n; ++i) {
+        float x = buf[i] * gain;
+        float a = fabsf(x);
+        float d = a - MIX_KNEE;
+        d = d > 0.0f ? d : 0.0f;
+        float y = (a < MIX_KNEE ? a : MIX_KNEE) + k * d / (k + d);
+        buf[i] = copysignf(y, x);
+    }
+}
+
+static void mix_biquad_scalar(float *buf, size_t n, const float coef[5], float state[4]) {
+    for (size_t i = 0; i + 2 <= n; i += 2) {
+        for (size_t c = 0; c < 2; ++c) {
+            float x = buf[i + c];
+            float y = (coef[0] * x + state[c] + MIX_DENORMAL) - MIX_DENORMAL;
+            state[c] = coef[1] * x - coef[3] * y + state[c + 2];
+            state[c + 2] = coef[2] * x - coef[4] * y;
+            buf[i + c] = y;
+        }
+    }
+}
+
+#ifdef MIX_X86
+// No fma on purpose: every path has to round exactly like the scalar one so the
+// output doesn't depend on the machine it was rendered on.
+__attribute__((target("sse2")))
+static void mix_add_sse2(float *dst, const float *src, size_t n, float gain) {
+    __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 d = _mm_loadu_ps(dst + i);
+        __m128 s = _mm_loadu_ps(src + i);
+        _mm_storeu_ps(dst + i, _mm_add_ps(d, _mm_mul_ps(s, g)));
+    }
+    mix_add_scalar(dst + i, src + i, n - i, gain);
+}
+
+__attribute__((target("sse2")))
+static void mix_master_sse2(float *buf, size_t n, float gain) {
+    __m128 g = _mm_set1_ps(gain);
+    __m128 knee = _mm_set1_ps(MIX_KNEE);
+    __m128 k = _mm_set1_ps(1.0f - MIX_KNEE);
+    __m128 sign = _mm_set1_ps(-0.0f);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_mul_ps(_mm_loadu_ps(buf + i), g);
+        __m128 a = _mm_andnot_ps(sign, x);
+        __m128 d = _mm_max_ps(_mm_sub_ps(a, knee), _mm_setzero_ps());
+        __m128 y = _mm_add_ps(_mm_min_ps(a, knee), _mm_div_ps(_mm_mul_ps(k, d), _mm_add_ps(k, d)));
+        _mm_storeu_ps(buf + i, _mm_or_ps(y, _mm_and_ps(sign, x)));
+    }
+    mix_master_scalar(buf + i, n - i, gain);
+}
+
+__attribute__((target("sse2")))
+static float mix_dot_sse2(const float *a, const float *b, size_t n) {
+    __m128 lo = _mm_setzero_ps(), hi = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        lo = _mm_add_ps(lo, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        hi = _mm_add_ps(hi, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float acc[8];
+    _mm_storeu_ps(acc, lo);
+    _mm_storeu_ps(acc + 4, hi);
+    return dotreduce(acc, a, b, i, n);
+}
+
+// Both channels of a frame go through the filter side by side in the low lanes
+__attribute__((target("sse2")))
+static void mix_biquad_sse2(float *buf, size_t n, const float coef[5], float state[4]) {
+    __m128 b0 = _mm_set1_ps(coef[0]), b1 = _mm_set1_ps(coef[1]), b2 = _mm_set1_ps(coef[2]);
+    __m128 a1 = _mm_set1_ps(coef[3]), a2 = _mm_set1_ps(coef[4]);
+    __m128 den = _mm_set1_ps(MIX_DENORMAL);
+    __m128 z1 = _mm_castpd_ps(_mm_load_sd((const double*)state));
+    __m128 z2 = _mm_castpd_ps(_mm_load_sd((const double*)(state + 2)));
+    for (size_t i = 0; i + 2 <= n; i += 2) {
+        __m128 x = _mm_castpd_ps(_mm_load_sd((const double*)(buf + i)));
+        __m128 y = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(b0, x), z1), den), den);
+        z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), z2);
+        z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+        _mm_store_sd((double*)(buf + i), _mm_castps_pd(y));
+    }
+    _mm_store_sd((double*)state, _mm_castps_pd(z1));
+    _mm_store_sd((double*)(state + 2), _mm_castps_pd(z2));
+}
+
+__attribute__((target("avx2")))
+static float mix_dot_avx2(const float *a, const float *b, size_t n) {
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+    float acc[8];
+    _mm256_storeu_ps(acc, sum);
+    return dotreduce(acc, a, b, i, n);
+}
+
+__attribute__((target("avx2")))
+static void mix_add_avx2(float *dst, const float *src, size_t n, float gain) {
+    __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_loadu_ps(dst + i);
+        __m256 d1 = _mm256_loadu_ps(dst + i + 8);
+        __m256 s0 = _mm256_loadu_ps(src + i);
+        __m256 s1 = _mm256_loadu_ps(src + i + 8);
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(d0, _mm256_mul_ps(s0, g)));
+        _mm256_storeu_ps(dst + i + 8, _mm256_add_ps(d1, _mm256_mul_ps(s1, g)));
+    }
+    mix_add_sse2(dst + i, src + i, n - i, gain);
+}
+
+// 4 frames at a time with gathers, the frames near the ends of src go through
+// the scalar loop so the gathers never read outside of it
+__attribute__((target("avx2")))
+static void mix_pitch_avx2(float *out, const float *src, size_t frames, size_t first, size_t n, double step, Interp interp) {
+    size_t j = 0;
+    if (n > 0 && first & 1) {
+        mix_pitch_scalar(out, src, frames, first, 1, step, interp);
+        j = 1;
+    }
+    if (frames * 2 >= INT32_MAX) {
+        mix_pitch_scalar(out + j, src, frames, first + j, n - j, step, interp);
+        return;
+    }
+    const __m256d lanes = _mm256_set_pd(3, 2, 1, 0);
+    const __m256i dup = _mm256_set_epi32(3, 3, 2, 2, 1, 1, 0, 0);
+    const __m256i chan = _mm256_set_epi32(1, 0, 1, 0, 1, 0, 1, 0);
+    __m256d st = _mm256_set1_pd(step);
+    for (; j + 8 <= n; j += 8) {
+        size_t fr = (first + j) / 2;
+        double lo = floor((double)fr * step), hi = floor((double)(fr + 3) * step);
+        if (lo < 1 || hi + 2 >= frames) {
+            mix_pitch_scalar(out + j, src, frames, first + j, 8, step, interp);
+            continue;
+        }
+        __m256d p = _mm256_mul_pd(_mm256_add_pd(_mm256_set1_pd((double)fr), lanes), st);
+        __m256d fl = _mm256_floor_pd(p);
+        __m256 f = _mm256_permutevar8x32_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(_mm256_sub_pd(p, fl))), dup);
+        __m256i i = _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(_mm256_cvttpd_epi32(fl)), dup);
+        __m256i idx = _mm256_add_epi32(_mm256_slli_epi32(i, 1), chan);
+        __m256 s0 = _mm256_i32gather_ps(src, idx, 4);
+        __m256 s1 = _mm256_i32gather_ps(src + 2, idx, 4);
+        __m256 v;
+        if (interp == INTERP_LINEAR) {
+            v = _mm256_add_ps(s0, _mm256_mul_ps(f, _mm256_sub_ps(s1, s0)));
+        } else {
+            __m256 sm1 = _mm256_i32gather_ps(src - 2, idx, 4);
+            __m256 s2 = _mm256_i32gather_ps(src + 4, idx, 4);
+            __m256 c1 = _mm256_mul_ps(_mm256_set1_ps(0.5f), _mm256_sub_ps(s1, sm1));
+            __m256 c2 = _mm256_sub_ps(_mm256_add_ps(_mm256_sub_ps(sm1, _mm256_mul_ps(_mm256_set1_ps(2.5f), s0)),
+                                                    _mm256_mul_ps(_mm256_set1_ps(2.0f), s1)),
+                                      _mm256_mul_ps(_mm256_set1_ps(0.5f), s2));
+            __m256 c3 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), _mm256_sub_ps(s2, sm1)),
+                                      _mm256_mul_ps(_mm256_set1_ps(1.5f), _mm256_sub_ps(s0, s1)));
+            v = _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(c3, f), c2), f), c1), f), s0);
+        }
+        _mm256_storeu_ps(out + j, v);
+    }
+    mix_pitch_scalar(out + j, src, frames, first + j, n - j, step, interp);
+}
+
+__attribute__((target("avx2")))
+static void mix_master_avx2(float *buf, size_t n, float gain) {
+    __m256 g = _mm256_set1_ps(gain);
+    __m256 knee = _mm256_set1_ps(MIX_KNEE);
+    __m256 k = _mm256_set1_ps(1.0f - MIX_KNEE);
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_mul_ps(_mm256_loadu_ps(buf + i), g);
+        __m256 a = _mm256_andnot_ps(sign, x);
+        __m256 d = _mm256_max_ps(_mm256_sub_ps(a, knee), _mm256_setzero_ps());
+        __m256 y = _mm256_add_ps(_mm256_min_ps(a, knee), _mm256_div_ps(_mm256_mul_ps(k, d), _mm256_add_ps(k, d)));
+        _mm256_storeu_ps(buf + i, _mm256_or_ps(y, _mm256_and_ps(sign, x)));
+    }
+    mix_master_sse2(buf + i, n - i, gain);
+}
+#endif
+
+static MixAddFn add_fn = mix_add_scalar;
+static MixMasterFn master_fn = mix_master_scalar;
+static MixDotFn dot_fn = mix_dot_scalar;
+// There is no SSE2 version, it has no gathers
+static MixPitchFn pitch_fn = mix_pitch_scalar;
+// The filter is recursive, wider registers would only hold more channels
+static MixBiquadFn biquad_fn = mix_biquad_scalar;
+static const char *impl = "scalar";
+static bool initialized = false;
+
+void mix_init(void) {
+    if (initialized) return;
+    initialized = true;
+#ifdef MIX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        add_fn = mix_add_avx2;
+        master_fn = mix_master_avx2;
+        dot_fn = mix_dot_avx2;
+        pitch_fn = mix_pitch_avx2;
+        biquad_fn = mix_biquad_sse2;
+        impl = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        add_fn = mix_add_sse2;
+        master_fn = mix_master_sse2;
+        dot_fn = mix_dot_sse2;
+        biquad_fn = mix_biquad_sse2;
+        impl = "sse2";
+    }
+#endif
+}
+
+const char *mix_impl(void) {
+    return impl;
+}
+
+void mix_add(float *dst, const float *src, size_t n, float gain) {
+    add_fn(dst, src, n, gain);
+}
+
+float mix_dot(const float *a, const float *b, size_t n) {
+    return dot_fn(a, b, n);
+}
+
+// Fades are only a few hundred floats long, they don't need a vector version
+void mix_fade(float *dst, const float *src, size_t n, size_t offset, size_t length, float gain) {
+    float pairs = length / 2;
+    for (size_t i = 0; i < n; ++i) {
+        float fade = 1.0f - (float)((offset + i) / 2) / pairs;
+        dst[i] += src[i] * ((fade > 0.0f ? fade : 0.0f) * gain);
+    }
+}
+
+void mix_pitch(float *out, const float *src, size_t frames, size_t first, size_t n, double step, Interp interp) {
+    pitch_fn(out, src, frames, first, n, step, interp);
+}
+
+void mix_master(float *buf, size_t n, float gain) {
+    master_fn(buf, n, gain);
+}
+
+void mix_biquad(float *buf, size_t n, const float coef[5], float state[4]) {
+    biquad_fn(buf, n, coef, state);
+}
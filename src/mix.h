@@ -0,0 +1,46 @@
+#ifndef MIX_H_
+#define MIX_H_
+
+#include <stdlib.h>
+
+// Gain applied to the summed voices before the limiter. Leaves about 6dB for
+// overlapping hits before they reach the knee.
+#define MIX_HEADROOM 0.5f
+// Level where the master limiter starts bending the signal down. Below it the
+// mix passes through untouched, above it the output approaches 1 but never
+// reaches it.
+#define MIX_KNEE 0.75f
+
+typedef enum {
+    INTERP_CUBIC,
+    INTERP_LINEAR,
+} Interp;
+
+// Picks the fastest kernels the cpu supports. Called once before rendering,
+// calling it again is harmless.
+void mix_init(void);
+const char *mix_impl(void);
+
+// dst[i] += src[i] * gain
+void mix_add(float *dst, const float *src, size_t n, float gain);
+// Sum of a[i] * b[i]. Every path adds in the same order, so the result doesn't
+// depend on the cpu either.
+float mix_dot(const float *a, const float *b, size_t n);
+// dst[i] += src[i] * gain, with the gain also going from 1 down to 0 over
+// `length` floats. src starts `offset` floats into the fade, both channels of a
+// frame get the same gain.
+void mix_fade(float *dst, const float *src, size_t n, size_t offset, size_t length, float gain);
+// Plays the stereo src (`frames` frames long) `step` times faster: out[i] is
+// float first + i of the result, interpolated between the neighbouring frames.
+// Frames past either end of src are silence.
+void mix_pitch(float *out, const float *src, size_t frames, size_t first, size_t n, double step, Interp interp);
+// buf[i] = buf[i] * gain, with anything above MIX_KNEE squashed smoothly into
+// the rest of the range instead of being clipped. Every sample is limited on its
+// own, so the result doesn't depend on how the song is split into blocks.
+void mix_master(float *buf, size_t n, float gain);
+// Runs the stereo buf (n floats) through a biquad, transposed direct form II.
+// coef is b0, b1, b2, a1, a2 normalized by a0, state is z1 and z2 of the left
+// and right channel ({ z1l, z1r, z2l, z2r }) and carries over to the next call.
+void mix_biquad(float *buf, size_t n, const float coef[5], float state[4]);
+
+#endif
@@ -2,17 +2,50 @@
 
 #include "parser.h"
 #include "audio.h"
+#include "stats.h"
 
 Func strtofunc(const Token *t) {
-    if (t->type == TT_NUM) return FUNC_UNKNOWN;
-    const char *str = t->value.asStr;
-    if (!strcmp(str, "load")) return FUNC_LOAD;
-    else if (!strcmp(str, "play")) return FUNC_PLAY;
-    else if (!strcmp(str, "add_to_sequence")) return FUNC_ADDPAT;
-    else if (!strcmp(str, "set_bpm")) return FUNC_BPM;
+    if (t->type != TT_WORD) return FUNC_UNKNOWN;
+    StrView str = t->value.asStr;
+    if (sv_eq(str, "load")) return FUNC_LOAD;
+    else if (sv_eq(str, "play")) return FUNC_PLAY;
+    else if (sv_eq(str, "add_to_sequence")) return FUNC_ADDPAT;
+    else if (sv_eq(str, "set_bpm")) return FUNC_BPM;
+    else if (sv_eq(str, "repeat")) return FUNC_REPEAT;
+    else if (sv_eq(str, "every")) return FUNC_EVERY;
     return FUNC_UNKNOWN;
 }
 
+// repeat and every are only keywords when called, samples and patterns can
+// still have these names
+static Func callfunc(const Lexer *l, const Token *t) {
+    Func f = strtofunc(t);
+    if ((f == FUNC_REPEAT || f == FUNC_EVERY) && lex_peek(l) != '(') {
+        return FUNC_UNKNOWN;
+    }
+    return f;
+}
+
+static size_t tokensym(const Token *t) {
+    return intern_n(t->value.asStr.data, t->value.asStr.len);
+}
+
+// A single number argument, integer or not
+static double numarg(const Tokens *arg, const Token *t) {
+    if (arg->count == 0) {
+        tokenexception(t);
+    }
+    if (arg->count > 1) {
+        tokenexception(&arg->items[1]);
+    }
+    Token argt = arg->items[0];
+    if (argt.type == TT_NUM) return argt.value.asNum;
+    if (argt.type != TT_DECIMAL) {
+        tokenexception(&arg->items[0]);
+    }
+    return argt.value.asDecimal;
+}
+
 Args parse_args(Lexer *l) {
     lex_expect(l, TT_OB);
 
@@ -28,42 +61,69 @@ Args parse_args(Lexer *l) {
                 tokenexception(&t);
                 break;
             case TT_COMMA:
-                DA_APPEND(&args, tokens);
-                tokens.count = 0;
-                tokens.capacity = 0;
+                DA_APPEND_ARENA(l->arena, &args, tokens);
+                tokens = (Tokens){0};
                 break;
             case TT_CB:
-                DA_APPEND(&args, tokens);
+                DA_APPEND_ARENA(l->arena, &args, tokens);
                 break;
             default:
-                DA_APPEND(&tokens, t);
+                DA_APPEND_ARENA(l->arena, &tokens, t);
                 break;
         }
     } while (t.type != TT_CB);
     return args;
 }
 
-void parse_block(Lexer *l, const char *name) {
-    lex_expect(l, TT_EOL);
+// A count of at least 1
+static size_t countarg(const Tokens *arg, const Token *t) {
+    if (arg->count == 0) {
+        tokenexception(t);
+    }
+    if (arg->count > 1) {
+        tokenexception(&arg->items[1]);
+    }
+    Token argt = arg->items[0];
+    if (argt.type != TT_NUM || argt.value.asNum < 1) {
+        tokenexception(&arg->items[0]);
+    }
+    return argt.value.asNum;
+}
+
+// A pitch in semitones within PITCH_RANGE
+static float pitcharg(const Tokens *arg, const Token *t) {
+    double pitch = numarg(arg, t);
+    if (pitch < -PITCH_RANGE || pitch > PITCH_RANGE) {
+        fprintf(stderr, "Error: pitch %g is out of range, it has to be between -%d and %d semitones\n", pitch, PITCH_RANGE, PITCH_RANGE);
+        lex_fail();
+    }
+    return pitch;
+}
+
+// Rows up to the closing }, counted from the first one. Returns how many there were.
+static size_t parse_rows(Lexer *l, Pattern *p) {
+    size_t firstloop = p->loops.count;
+    // The arguments of a row are done with once it is added
+    ArenaMark mark = arena_mark(l->arena);
     Token t = lex_next(l);
     size_t row = 0;
-    Pattern p = {0};
     while (t.type != TT_CCB) {
         if (t.type == TT_EOF) {
             fprintf(stderr, "Error: unexpected end of file while parsing music block\n");
-            exit(1);
+            lex_fail();
         } else if (t.type == TT_EOL) {
             row ++;
             t = lex_next(l);
             continue;
         }
-        Func func = strtofunc(&t);
+        Func func = callfunc(l, &t);
         switch (func) {
             case FUNC_PLAY:
+                // play(sample, pitch in semitones, gain)
                 Args args = parse_args(l);
-                if (args.count > 1) {
+                if (args.count > 3) {
                     fprintf(stderr, "Error: too many arguments\n");
-                    exit(1);
+                    lex_fail();
                 }
                 Tokens argstoks = args.items[0];
                 if (argstoks.count > 1) {
@@ -73,13 +133,15 @@ void parse_block(Lexer *l, const char *name) {
                 if (argt.type != TT_WORD) {
                     tokenexception(&argstoks.items[0]);
                 }
-                addsampleinstance(argt.value.asStr, &p, row);
+                float pitch = args.count > 1 ? pitcharg(&args.items[1], &t) : 0;
+                float gain = args.count > 2 ? numarg(&args.items[2], &t) : 1;
+                addsampleinstance(tokensym(&argt), p, row, pitch, gain);
                 break;
             case FUNC_BPM:
                 args = parse_args(l);
                 if (args.count > 1) {
                     fprintf(stderr, "Error: too many arguments\n");
-                    exit(1);
+                    lex_fail();
                 }
                 argstoks = args.items[0];
                 if (argstoks.count > 1) {
@@ -89,20 +151,118 @@ void parse_block(Lexer *l, const char *name) {
                 if (argt.type != TT_NUM) {
                     tokenexception(&argstoks.items[0]);
                 }
-                addbpmchange(argt.value.asNum, &p, row);
+                addbpmchange(argt.value.asNum, p, row);
+                break;
+            case FUNC_REPEAT:
+                // repeat(times) { rows }
+                args = parse_args(l);
+                if (args.count > 1) {
+                    fprintf(stderr, "Error: too many arguments\n");
+                    lex_fail();
+                }
+                size_t times = countarg(&args.items[0], &t);
+                lex_expect(l, TT_OCB);
+                lex_expect(l, TT_EOL);
+                size_t loop = beginloop(p, row, times);
+                size_t rows = parse_rows(l, p);
+                endloop(p, loop, rows);
+                // The line of the closing } isn't a row of its own
+                lex_expect(l, TT_EOL);
+                row += rows * times;
+                break;
+            case FUNC_EVERY:
+                // every(rows, sample, pitch in semitones, gain)
+                args = parse_args(l);
+                if (args.count < 2) {
+                    tokenexception(&t);
+                }
+                if (args.count > 4) {
+                    fprintf(stderr, "Error: too many arguments\n");
+                    lex_fail();
+                }
+                size_t period = countarg(&args.items[0], &t);
+                argstoks = args.items[1];
+                if (argstoks.count == 0) {
+                    tokenexception(&t);
+                }
+                if (argstoks.count > 1) {
+                    tokenexception(&argstoks.items[1]);
+                }
+                argt = argstoks.items[0];
+                if (argt.type != TT_WORD) {
+                    tokenexception(&argstoks.items[0]);
+                }
+                pitch = args.count > 2 ? pitcharg(&args.items[2], &t) : 0;
+                gain = args.count > 3 ? numarg(&args.items[3], &t) : 1;
+                addevery(tokensym(&argt), p, row, period, pitch, gain);
                 break;
             default:
                 if (t.type != TT_WORD) {
                     fprintf(stderr, "Error: expected sample name or play function. But got: %s\n", printablevalue(&t));
-                    exit(1);
+                    lex_fail();
                 }
-                addsampleinstance(t.value.asStr, &p, row);
+                addsampleinstance(tokensym(&t), p, row, 0, 1);
                 break;
         }
+        arena_rewind(l->arena, mark);
         t = lex_next(l);
     }
-    p.rows = row;
-    addpattern(&p, name);
+    endbody(p, firstloop, row);
+    return row;
+}
+
+// The block being parsed, parse() frees it when the block has an error
+static Pattern block;
+
+void parse_block(Lexer *l, size_t name) {
+    lex_expect(l, TT_EOL);
+    block = (Pattern){0};
+    block.rows = parse_rows(l, &block);
+    addpattern(&block, name);
+    block = (Pattern){0};
+}
+
+// effect(target, parameters) where the target is a sample, a pattern or master
+static void parse_effect(Lexer *l, const Token *t, EffectType type) {
+    Args args = parse_args(l);
+    if (args.count > FX_MAX_PARAMS + 1) {
+        fprintf(stderr, "Error: too many arguments\n");
+        lex_fail();
+    }
+    Tokens targettoks = args.items[0];
+    if (targettoks.count == 0) {
+        tokenexception(t);
+    }
+    if (targettoks.count > 1) {
+        tokenexception(&targettoks.items[1]);
+    }
+    Token target = targettoks.items[0];
+    if (target.type != TT_WORD) {
+        tokenexception(&target);
+    }
+    Effect fx = { .type = type };
+    for (size_t i = 1; i < args.count; ++i) {
+        fx.params[i - 1] = numarg(&args.items[i], t);
+    }
+    const char *err = fx_check(&fx, args.count - 1);
+    if (err != NULL) {
+        fprintf(stderr, "Error in `%s()`: %s\n", fx_name(type), err);
+        lex_fail();
+    }
+    if (sv_eq(target.value.asStr, "master")) {
+        addeffect(FXT_MASTER, 0, &fx);
+        return;
+    }
+    size_t name = tokensym(&target);
+    Symbol *sym = symbol(name);
+    if (sym->sample != SYM_NONE) {
+        addeffect(FXT_SAMPLE, sym->sample, &fx);
+    } else if (sym->pattern != SYM_NONE) {
+        addeffect(FXT_PATTERN, sym->pattern, &fx);
+    } else {
+        fprintf(stderr, "Error: no sample or pattern named %s\n", symname(name));
+        lex_fail();
+    }
 }
 
 void parse_declaration(Lexer *l, const Token *t) {
@@ -114,9 +274,25 @@ void parse_declaration(Lexer *l, const Token *t) {
     Func func = strtofunc(&value);
     if (func == FUNC_LOAD) {
         Args args = parse_args(l);
-        if (args.count > 1) {
+        if (args.count > 2) {
             fprintf(stderr, "Error: too many arguments\n");
-            exit(1);
+            lex_fail();
+        }
+        // Optional second argument: the choke group
+        size_t choke = 0;
+        if (args.count == 2) {
+            Tokens chokearg = args.items[1];
+            if (chokearg.count == 0) {
+                fprintf(stderr, "Error in `load()`: missing choke group after the comma\n");
+                lex_fail();
+            }
+            if (chokearg.count > 1) {
+                tokenexception(&chokearg.items[1]);
+            }
+            if (chokearg.items[0].type != TT_NUM) {
+                tokenexception(&chokearg.items[0]);
+            }
+            choke = chokearg.items[0].value.asNum;
         }
         Tokens argstoks = args.items[0];
         if (argstoks.count > 1) {
@@ -126,60 +302,87 @@ void parse_declaration(Lexer *l, const Token *t) {
         if (argt.type != TT_STRLIT) {
             tokenexception(&argstoks.items[0]);
         }
-        loadsample(argt.value.asStr, t->value.asStr);
-    } else if (func == FUNC_UNKNOWN) {
-        lex_expect(l, TT_OCB);
-        parse_block(l, t->value.asStr);
+        char path[STR_MAX_SZ];
+        snprintf(path, sizeof(path), "%.*s", (int)argt.value.asStr.len, argt.value.asStr.data);
+        loadsample(path, tokensym(t), choke);
+    } else if (value.type == TT_OCB) {
+        parse_block(l, tokensym(t));
     } else {
         tokenexception(t);
     }
 }
 
-void parse(const char *filepath) {
-    char data[BUF_SZ + 1] = {0};
-
-    Buffer buf = {
-        .data = data,
-        .size = BUF_SZ,
-        .pos  = 0,
-    };
-
-    Lexer l = lex_init(filepath, &buf);
+static void parsefile(const char *filepath, Lexer *l) {
+    *l = lex_init(filepath, l->buf, l->arena);
+    // What parse_args() builds only lives until its statement is done, the
+    // arena goes back to this mark after every one
+    ArenaMark mark = arena_mark(l->arena);
+    if (stats_enabled) {
+        lex_stats(l);
+    }
+    uint64_t start = stats_begin();
 
-    Token t = lex_next(&l);
+    Token t = lex_next(l);
     while (t.type != TT_EOF) {
         switch (t.type) {
             case TT_OCB:
-                parse_block(&l, NULL);
+                parse_block(l, SYM_NONE);
                 break;
             case TT_WORD:
-                Func f = strtofunc(&t);
+                Func f = callfunc(l, &t);
+                EffectType fx = fx_lookup(t.value.asStr.data, t.value.asStr.len);
                 if (f == FUNC_ADDPAT) {
-                    Args args = parse_args(&l);
+                    Args args = parse_args(l);
                     for (size_t i = 0; i < args.count; ++i) {
                         Tokens arg = args.items[i];
                         if (arg.count != 1) {
                             fprintf(stderr, "Error when parsing `add_to_sequence()` function arguments\n");
-                            exit(1);
+                            lex_fail();
                         }
                         Token argt = arg.items[0];
                         if (argt.type != TT_WORD) {
                             fprintf(stderr, "Error when parsing `add_to_sequence()` function arguments\n");
-                            exit(1);
+                            lex_fail();
                         }
-                        addtosequence(argt.value.asStr);
+                        addtosequence(tokensym(&argt));
                     }
+                } else if (fx != FX_COUNT && lex_peek(l) == '(') {
+                    // Only when called, samples and patterns can still have these names
+                    parse_effect(l, &t, fx);
                 } else if (f == FUNC_UNKNOWN) {
-                    parse_declaration(&l, &t);
+                    parse_declaration(l, &t);
                 } else {
                     fprintf(stderr, "Error: unexpected function: %s\n", printablevalue(&t));
-                    exit(1);
+                    lex_fail();
                 }
             case TT_EOL:
                 break;
             default:
                 tokenexception(&t);
         }
-        t = lex_next(&l);
+        arena_rewind(l->arena, mark);
+        t = lex_next(l);
+    }
+    stats_end(PH_PARSE, start);
+}
+
+bool parse(const char *filepath) {
+    Arena arena = {0};
+    Buffer buf = {0};
+    Lexer l = { .buf = &buf, .arena = &arena };
+    // Errors in the script come back here through lex_fail()
+    jmp_buf onerror;
+    lex_onerror = &onerror;
+    bool ok = setjmp(onerror) == 0;
+    if (ok) {
+        parsefile(filepath, &l);
+    } else {
+        free(block.items);
+        free(block.loops.items);
+        block = (Pattern){0};
     }
+    lex_onerror = NULL;
+    lex_close(&l);
+    arena_free(&arena);
+    return ok;
 }
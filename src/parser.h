@@ -18,13 +18,18 @@ typedef enum {
     FUNC_PLAY,
     FUNC_ADDPAT,
     FUNC_BPM,
+    FUNC_REPEAT,
+    FUNC_EVERY,
     FUNC_COUNT,
 } Func;
 
 Func strtofunc(const Token *t);
 Args parse_args(Lexer *l);
-void parse_block(Lexer *l, const char *name);
+void parse_block(Lexer *l, size_t name);
 void parse_declaration(Lexer *l, const Token *t);
-void parse(const char *filepath);
+// Adds what the script defines to the project. Stops at the first error in
+// the script and returns false once it is printed, the project may hold part
+// of the script then and needs a resetproject().
+bool parse(const char *filepath);
 
 #endif
@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "project.h"
+#include "parser.h"
+#include "audio.h"
+#include "stats.h"
+
+#define PROJECT_MAGIC "TRNGPRJ"
+#define PROJECT_VERSION 3
+
+// The file is the header followed by the samples, patterns, items, loops, effects,
+// sequence and the NUL terminated strings the other records point to by offset
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t srcsize;
+    int64_t srcsec;
+    int64_t srcnsec;
+    uint64_t nsamples;
+    uint64_t npatterns;
+    uint64_t nitems;
+    uint64_t nloops;
+    uint64_t neffects;
+    uint64_t nsequence;
+    uint64_t strsize;
+} ProjectHeader;
+
+typedef struct {
+    uint64_t name;
+    uint64_t path;
+    uint64_t choke;
+} ProjectSample;
+
+// Items [first, first + count) of the items array and loops [firstloop,
+// firstloop + nloops) of the loops array. The loops point at items of the pattern.
+typedef struct {
+    uint64_t name;
+    uint64_t rows;
+    uint64_t first;
+    uint64_t count;
+    uint64_t firstloop;
+    uint64_t nloops;
+} ProjectPattern;
+
+typedef struct {
+    uint64_t sample;
+    uint64_t row;
+    uint32_t pctype;
+    float pcvalue;
+    float pitch;
+    float gain;
+} ProjectItem;
+
+typedef struct {
+    uint64_t row;
+    uint64_t period;
+    uint64_t times;
+    uint64_t first;
+    uint64_t count;
+    uint64_t nested;
+} ProjectLoop;
+
+// Effects are stored in the order they get added back in: the ones of the
+// samples, of the patterns, then of the master
+typedef struct {
+    uint32_t target;
+    uint32_t type;
+    uint64_t index;
+    float params[FX_MAX_PARAMS];
+    uint32_t reserved;
+} ProjectEffect;
+
+static bool compiledpath(const char *filepath, char out[PATH_MAX]) {
+    int n = snprintf(out, PATH_MAX, "%sc", filepath);
+    return n > 0 && n < PATH_MAX;
+}
+
+static struct {
+    char *items;
+    size_t count;
+    size_t capacity;
+} strings;
+
+static uint64_t addstring(const char *s) {
+    uint64_t off = strings.count;
+    for (size_t i = 0; i <= strlen(s); ++i) {
+        DA_APPEND(&strings, s[i]);
+    }
+    return off;
+}
+
+static void addeffects(ProjectEffect *pe, size_t *n, EffectTarget target, size_t index, const Effects *fx) {
+    for (size_t i = 0; i < fx->count; ++i) {
+        ProjectEffect *e = &pe[(*n)++];
+        *e = (ProjectEffect){ .target = target, .type = fx->items[i].type, .index = index };
+        memcpy(e->params, fx->items[i].params, sizeof(e->params));
+    }
+}
+
+// Writes the parsed project to `file` through a temporary file next to it, so a
+// failed write leaves whatever was there. Returns false with errno set on failure.
+static bool writeproject(const char *file, const struct stat *st) {
+    char tmp[PATH_MAX];
+    const Samples *samples = projectsamples();
+    const Patterns *patterns = projectpatterns();
+    const Sequence *sequence = projectsequence();
+    const Effects *masterfx = projectmasterfx();
+    size_t nitems = 0, nloops = 0, neffects = masterfx->count;
+    for (size_t i = 0; i < samples->count; ++i) {
+        neffects += samples->items[i].fx.count;
+    }
+    for (size_t i = 0; i < patterns->count; ++i) {
+        nitems += patterns->items[i].count;
+        nloops += patterns->items[i].loops.count;
+        neffects += patterns->items[i].fx.count;
+    }
+    ProjectSample *ps = calloc(samples->count + 1, sizeof(ProjectSample));
+    ProjectPattern *pp = calloc(patterns->count + 1, sizeof(ProjectPattern));
+    ProjectItem *pi = calloc(nitems + 1, sizeof(ProjectItem));
+    ProjectLoop *pl = calloc(nloops + 1, sizeof(ProjectLoop));
+    ProjectEffect *pe = calloc(neffects + 1, sizeof(ProjectEffect));
+    uint64_t *seq = calloc(sequence->count + 1, sizeof(uint64_t));
+    if (ps == NULL || pp == NULL || pi == NULL || pl == NULL || pe == NULL || seq == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    strings.count = 0;
+    for (size_t i = 0; i < samples->count; ++i) {
+        const Sample *s = &samples->items[i];
+        ps[i] = (ProjectSample){ .name = addstring(symname(s->name)), .path = addstring(s->path), .choke = s->choke };
+    }
+    size_t item = 0, loop = 0;
+    for (size_t i = 0; i < patterns->count; ++i) {
+        const Pattern *p = &patterns->items[i];
+        pp[i] = (ProjectPattern){
+            .name = addstring(symname(p->name)),
+            .rows = p->rows,
+            .first = item,
+            .count = p->count,
+            .firstloop = loop,
+            .nloops = p->loops.count,
+        };
+        for (size_t j = 0; j < p->loops.count; ++j) {
+            const Loop *lp = &p->loops.items[j];
+            pl[loop++] = (ProjectLoop){ lp->row, lp->period, lp->times, lp->first, lp->count, lp->nested };
+        }
+        for (size_t j = 0; j < p->count; ++j) {
+            const AudioObject *ao = &p->items[j];
+            pi[item++] = (ProjectItem){
+                .sample = ao->sample == SYM_NONE ? UINT64_MAX : ao->sample,
+                .row = ao->row,
+                .pctype = ao->pc.type,
+                .pcvalue = ao->pc.value,
+                .pitch = ao->pitch,
+                .gain = ao->gain,
+            };
+        }
+    }
+    size_t effect = 0;
+    for (size_t i = 0; i < samples->count; ++i) {
+        addeffects(pe, &effect, FXT_SAMPLE, i, &samples->items[i].fx);
+    }
+    for (size_t i = 0; i < patterns->count; ++i) {
+        addeffects(pe, &effect, FXT_PATTERN, i, &patterns->items[i].fx);
+    }
+    addeffects(pe, &effect, FXT_MASTER, 0, masterfx);
+    for (size_t i = 0; i < sequence->count; ++i) {
+        seq[i] = sequence->items[i];
+    }
+
+    ProjectHeader h = {
+        .magic = PROJECT_MAGIC,
+        .version = PROJECT_VERSION,
+        .srcsize = st->st_size,
+        .srcsec = st->st_mtim.tv_sec,
+        .srcnsec = st->st_mtim.tv_nsec,
+        .nsamples = samples->count,
+        .npatterns = patterns->count,
+        .nitems = nitems,
+        .nloops = nloops,
+        .neffects = neffects,
+        .nsequence = sequence->count,
+        .strsize = strings.count,
+    };
+    FILE *f = NULL;
+    int fd = -1;
+    if (snprintf(tmp, PATH_MAX, "%s.XXXXXX", file) < PATH_MAX) {
+        fd = mkstemp(tmp);
+    }
+    // It sits next to the script, not in a private cache
+    if (fd >= 0) fchmod(fd, 0644);
+    if (fd >= 0 && (f = fdopen(fd, "wb")) == NULL) {
+        close(fd);
+    }
+    bool ok = f != NULL
+           && fwrite(&h, sizeof(h), 1, f) == 1
+           && fwrite(ps, sizeof(ProjectSample), h.nsamples, f) == h.nsamples
+           && fwrite(pp, sizeof(ProjectPattern), h.npatterns, f) == h.npatterns
+           && fwrite(pi, sizeof(ProjectItem), h.nitems, f) == h.nitems
+           && fwrite(pl, sizeof(ProjectLoop), h.nloops, f) == h.nloops
+           && fwrite(pe, sizeof(ProjectEffect), h.neffects, f) == h.neffects
+           && fwrite(seq, sizeof(uint64_t), h.nsequence, f) == h.nsequence
+           && fwrite(strings.items, 1, h.strsize, f) == h.strsize;
+    if (f != NULL) ok = (fclose(f) == 0) && ok;
+    ok = ok && rename(tmp, file) == 0;
+    int err = errno;
+    if (!ok && fd >= 0) unlink(tmp);
+    free(ps);
+    free(pp);
+    free(pi);
+    free(pl);
+    free(pe);
+    free(seq);
+    errno = err;
+    return ok;
+}
+
+void project_compile(const char *filepath) {
+    struct stat st;
+    char file[PATH_MAX];
+    if (stat(filepath, &st) != 0 || !compiledpath(filepath, file)) {
+        fprintf(stderr, "Error: could not compile %s\n", filepath);
+        exit(1);
+    }
+    if (!parse(filepath)) {
+        exit(1);
+    }
+    if (!writeproject(file, &st)) {
+        fprintf(stderr, "Error while writing the file %s: %s\n", file, strerror(errno));
+        exit(1);
+    }
+}
+
+// Everything is checked before anything is added, a broken file is just stale
+static bool validproject(const char *map, size_t size, const struct stat *src) {
+    const ProjectHeader *h = (const ProjectHeader*)map;
+    if (size < sizeof(ProjectHeader)
+            || memcmp(h->magic, PROJECT_MAGIC, sizeof(h->magic))
+            || h->version != PROJECT_VERSION
+            || h->srcsize != (uint64_t)src->st_size
+            || h->srcsec != src->st_mtim.tv_sec || h->srcnsec != src->st_mtim.tv_nsec) {
+        return false;
+    }
+    uint64_t max = size;
+    if (h->nsamples > max || h->npatterns > max || h->nitems > max || h->nloops > max || h->neffects > max
+            || h->nsequence > max || h->strsize > max
+            || sizeof(ProjectHeader) + h->nsamples * sizeof(ProjectSample) + h->npatterns * sizeof(ProjectPattern)
+               + h->nitems * sizeof(ProjectItem) + h->nloops * sizeof(ProjectLoop) + h->neffects * sizeof(ProjectEffect)
+               + h->nsequence * sizeof(uint64_t) + h->strsize != size) {
+        return false;
+    }
+    const ProjectSample *ps = (const ProjectSample*)(h + 1);
+    const ProjectPattern *pp = (const ProjectPattern*)(ps + h->nsamples);
+    const ProjectItem *pi = (const ProjectItem*)(pp + h->npatterns);
+    const ProjectLoop *pl = (const ProjectLoop*)(pi + h->nitems);
+    const ProjectEffect *pe = (const ProjectEffect*)(pl + h->nloops);
+    const uint64_t *seq = (const uint64_t*)(pe + h->neffects);
+    const char *str = (const char*)(seq + h->nsequence);
+    if (h->strsize == 0 || str[h->strsize - 1] != '\0') {
+        return h->nsamples == 0 && h->npatterns == 0 && h->nsequence == 0;
+    }
+    for (size_t i = 0; i < h->nsamples; ++i) {
+        if (ps[i].name >= h->strsize || ps[i].path >= h->strsize) return false;
+    }
+    for (size_t i = 0; i < h->npatterns; ++i) {
+        if (pp[i].name >= h->strsize || pp[i].first > h->nitems || pp[i].count > h->nitems - pp[i].first) return false;
+        if (pp[i].firstloop > h->nloops || pp[i].nloops > h->nloops - pp[i].firstloop) return false;
+        for (size_t j = pp[i].firstloop; j < pp[i].firstloop + pp[i].nloops; ++j) {
+            if (pl[j].first > pp[i].count || pl[j].count > pp[i].count - pl[j].first) return false;
+            if (pl[j].nested >= pp[i].firstloop + pp[i].nloops - j) return false;
+        }
+    }
+    for (size_t i = 0; i < h->nitems; ++i) {
+        if (pi[i].sample != UINT64_MAX && pi[i].sample >= h->nsamples) return false;
+        if (pi[i].pctype >= PT_COUNT) return false;
+    }
+    for (size_t i = 0; i < h->neffects; ++i) {
+        if (pe[i].target >= FXT_COUNT || pe[i].type >= FX_COUNT) return false;
+        if (pe[i].target == FXT_SAMPLE && pe[i].index >= h->nsamples) return false;
+        if (pe[i].target == FXT_PATTERN && pe[i].index >= h->npatterns) return false;
+        Effect fx = { .type = pe[i].type };
+        memcpy(fx.params, pe[i].params, sizeof(fx.params));
+        if (fx_check(&fx, FX_MAX_PARAMS) != NULL) return false;
+    }
+    for (size_t i = 0; i < h->nsequence; ++i) {
+        if (seq[i] >= h->npatterns) return false;
+    }
+    return true;
+}
+
+static bool loadcompiled(const char *file, const struct stat *src) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    if (!validproject(map, st.st_size, src)) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    const ProjectHeader *h = (const ProjectHeader*)map;
+    const ProjectSample *ps = (const ProjectSample*)(h + 1);
+    const ProjectPattern *pp = (const ProjectPattern*)(ps + h->nsamples);
+    const ProjectItem *pi = (const ProjectItem*)(pp + h->npatterns);
+    const ProjectLoop *pl = (const ProjectLoop*)(pi + h->nitems);
+    const ProjectEffect *pe = (const ProjectEffect*)(pl + h->nloops);
+    const uint64_t *seq = (const uint64_t*)(pe + h->neffects);
+    const char *str = (const char*)(seq + h->nsequence);
+    // Samples and patterns are added in their original order, so the indices
+    // stored in the items and the sequence stay the same
+    for (size_t i = 0; i < h->nsamples; ++i) {
+        loadsample(str + ps[i].path, intern(str + ps[i].name), ps[i].choke);
+    }
+    for (size_t i = 0; i < h->npatterns; ++i) {
+        Pattern p = { .rows = pp[i].rows };
+        for (size_t j = pp[i].first; j < pp[i].first + pp[i].count; ++j) {
+            AudioObject ao = {
+                .sample = pi[j].sample == UINT64_MAX ? SYM_NONE : pi[j].sample,
+                .pc = { .type = pi[j].pctype, .value = pi[j].pcvalue },
+                .row = pi[j].row,
+                .pitch = pi[j].pitch,
+                .gain = pi[j].gain,
+            };
+            DA_APPEND(&p, ao);
+        }
+        for (size_t j = pp[i].firstloop; j < pp[i].firstloop + pp[i].nloops; ++j) {
+            Loop lp = { pl[j].row, pl[j].period, pl[j].times, pl[j].first, pl[j].count, pl[j].nested };
+            DA_APPEND(&p.loops, lp);
+        }
+        addpattern(&p, intern(str + pp[i].name));
+    }
+    for (size_t i = 0; i < h->neffects; ++i) {
+        Effect fx = { .type = pe[i].type };
+        memcpy(fx.params, pe[i].params, sizeof(fx.params));
+        addeffect(pe[i].target, pe[i].index, &fx);
+    }
+    for (size_t i = 0; i < h->nsequence; ++i) {
+        addtosequence(intern(str + pp[seq[i]].name));
+    }
+    munmap(map, st.st_size);
+    return true;
+}
+
+bool project_open(const char *filepath) {
+    struct stat src;
+    char file[PATH_MAX];
+    if (stat(filepath, &src) != 0 || !compiledpath(filepath, file)) {
+        return parse(filepath);
+    }
+    uint64_t start = stats_begin();
+    if (loadcompiled(file, &src)) {
+        stats_end(PH_PARSE, start);
+        return true;
+    }
+    if (!parse(filepath)) {
+        return false;
+    }
+    // Only an optimization here, the script is parsed either way
+    if (access(file, F_OK) == 0 && !writeproject(file, &src)) {
+        fprintf(stderr, "Warning: could not update %s: %s\n", file, strerror(errno));
+    }
+    return true;
+}
@@ -0,0 +1,18 @@
+#ifndef PROJECT_H_
+#define PROJECT_H_
+
+#include <stdbool.h>
+
+// A compiled project is the parsed script (samples, patterns and the sequence)
+// saved next to it as <script>c. It stores the size and mtime of the script it
+// came from and is only used while they still match.
+
+// Parses the script and writes its compiled project
+void project_compile(const char *filepath);
+// Loads the compiled project of the script when it is up to date. Otherwise the
+// script is parsed, and a compiled project that was there gets rebuilt when it
+// can be written (a warning is printed when it can't). Returns false when the
+// script has an error, like parse().
+bool project_open(const char *filepath);
+
+#endif
@@ -0,0 +1,784 @@
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <sndfile.h>
+
+#include "render.h"
+#include "mix.h"
+#include "stats.h"
+
+RenderOptions renderopts = { .jobs = 1, .format = OUT_WAV };
+
+// Where the rendered blocks go: a seekable WAV file written by libsndfile or a
+// raw stream written with plain write()s
+typedef struct {
+    const char *path;
+    SNDFILE *file;
+    int fd;
+    OutputFormat format;
+    int16_t *pcm;
+    // Stays all zeros, silent blocks are written straight from it
+    uint8_t *zeros;
+} Output;
+
+static void writeall(Output *o, const void *data, size_t size) {
+    const char *p = data;
+    while (size > 0) {
+        ssize_t n = write(o->fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "Error while writing to the file %s: %s\n", o->path, strerror(errno));
+            exit(1);
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+static void put16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put32(uint8_t *p, uint32_t v) { put16(p, v); put16(p + 2, v >> 16); }
+
+// The stream length isn't known up front, so the sizes are left at their
+// maximum the way streaming tools expect
+static void writewavheader(Output *o) {
+    uint16_t bytes = o->format == OUT_F32LE ? 4 : 2;
+    uint8_t h[44];
+    memcpy(h, "RIFF", 4);
+    put32(h + 4, UINT32_MAX);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put32(h + 16, 16);
+    put16(h + 20, o->format == OUT_F32LE ? 3 : 1);
+    put16(h + 22, 2);
+    put32(h + 24, SAMPLE_RATE);
+    put32(h + 28, SAMPLE_RATE * 2 * bytes);
+    put16(h + 32, 2 * bytes);
+    put16(h + 34, bytes * 8);
+    memcpy(h + 36, "data", 4);
+    put32(h + 40, UINT32_MAX);
+    writeall(o, h, sizeof(h));
+}
+
+static void output_open(Output *o, const char *path) {
+    *o = (Output){ .path = path, .fd = -1, .format = renderopts.format };
+    bool header = renderopts.wavheader;
+    if (!strcmp(path, "-")) {
+        o->fd = STDOUT_FILENO;
+    } else {
+        struct stat st;
+        bool regular = stat(path, &st) != 0 || S_ISREG(st.st_mode);
+        if (o->format != OUT_WAV || !regular) {
+            o->fd = open(path, O_WRONLY | O_CREAT | (regular ? O_TRUNC : 0), 0644);
+            if (o->fd < 0) {
+                fprintf(stderr, "Error while opening the file %s: %s\n", path, strerror(errno));
+                exit(1);
+            }
+        }
+    }
+    // A WAV going to a pipe can't have its header patched at the end, so it is
+    // streamed as 16 bit PCM behind a header without a length
+    if (o->fd >= 0 && o->format == OUT_WAV) {
+        o->format = OUT_S16LE;
+        header = true;
+    }
+    o->zeros = calloc(TILE_FRAMES, sizeof(float));
+    assert(o->zeros != NULL);
+    if (o->fd >= 0) {
+        o->pcm = malloc(TILE_FRAMES * sizeof(int16_t));
+        assert(o->pcm != NULL);
+        if (header) writewavheader(o);
+        return;
+    }
+
+    SF_INFO sfinfo;
+    sfinfo.samplerate = SAMPLE_RATE;
+    sfinfo.channels = 2;
+    sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16 | SF_ENDIAN_FILE;
+    o->file = sf_open(path, SFM_WRITE, &sfinfo);
+    if (o->file == NULL) {
+        fprintf(stderr, "Error while opening the file %s: %s\n", path, sf_strerror(o->file));
+        exit(1);
+    }
+}
+
+// A silent buf is all zeros, the output doesn't have to look at it. The WAV
+// written by libsndfile is 16 bit PCM, where silence is zero bytes as well.
+static void output_convert(Output *o, const Frame *buf, size_t n, bool silent) {
+    size_t bytes = o->format == OUT_F32LE && o->file == NULL ? 4 : 2;
+    if (silent) {
+        for (size_t off = 0; off < n; off += TILE_FRAMES) {
+            size_t chunk = n - off < TILE_FRAMES ? n - off : TILE_FRAMES;
+            if (o->file == NULL) {
+                writeall(o, o->zeros, chunk * bytes);
+            } else if ((sf_count_t)(chunk * bytes) != sf_write_raw(o->file, o->zeros, chunk * bytes)) {
+                fprintf(stderr, "Error while writing to the file %s: %s\n", o->path, sf_strerror(o->file));
+                sf_close(o->file);
+                exit(1);
+            }
+        }
+        return;
+    }
+    if (o->file != NULL) {
+        if ((sf_count_t) n != sf_write_float(o->file, buf, n)) {
+            fprintf(stderr, "Error while writing to the file %s: %s\n", o->path, sf_strerror(o->file));
+            sf_close(o->file);
+            exit(1);
+        }
+        return;
+    }
+    if (o->format == OUT_F32LE && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {
+        writeall(o, buf, n * sizeof(Frame));
+        return;
+    }
+    while (n > 0) {
+        size_t chunk = n < TILE_FRAMES / 2 ? n : TILE_FRAMES / 2;
+        uint8_t *out = (uint8_t*)o->pcm;
+        for (size_t i = 0; i < chunk; ++i) {
+            if (o->format == OUT_F32LE) {
+                union { float f; uint32_t u; } v = { .f = buf[i] };
+                put32(out + i * 4, v.u);
+            } else {
+                put16(out + i * 2, (uint16_t)(int16_t)lrintf(buf[i] * 0x7FFF));
+            }
+        }
+        writeall(o, out, chunk * (o->format == OUT_F32LE ? 4 : 2));
+        buf += chunk;
+        n -= chunk;
+    }
+}
+
+static void output_write(Output *o, const Frame *buf, size_t n, bool silent) {
+    uint64_t start = stats_begin();
+    output_convert(o, buf, n, silent);
+    stats_count(CT_FRAMES_WRITTEN, n);
+    stats_end(PH_WRITE, start);
+}
+
+static void output_close(Output *o) {
+    if (o->file != NULL) {
+        sf_close(o->file);
+    } else if (o->fd != STDOUT_FILENO) {
+        close(o->fd);
+    }
+    free(o->pcm);
+    free(o->zeros);
+}
+
+// Windows that can be waiting for the writer thread before the renderer has to stop
+#define WRITER_BLOCKS 4
+
+// Hands rendered windows over to a thread that converts and writes them, so a
+// slow output (a network mount, a pipe nobody is reading) stalls the mixing
+// only once all the blocks are full
+typedef struct {
+    Output *out;
+    Frame *bufs;
+    size_t block_frames;
+    size_t counts[WRITER_BLOCKS];
+    bool silent[WRITER_BLOCKS];
+    size_t head;
+    size_t tail;
+    bool done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} Writer;
+
+static void *writerthread(void *arg) {
+    Writer *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->tail == w->head && !w->done) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->tail == w->head) break;
+        size_t b = w->tail % WRITER_BLOCKS;
+        pthread_mutex_unlock(&w->lock);
+        output_write(w->out, w->bufs + b * w->block_frames, w->counts[b], w->silent[b]);
+        pthread_mutex_lock(&w->lock);
+        w->tail++;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void writer_start(Writer *w, Output *out, size_t block_frames) {
+    *w = (Writer){ .out = out, .block_frames = block_frames };
+    w->bufs = malloc(WRITER_BLOCKS * block_frames * sizeof(Frame));
+    if (w->bufs == NULL) {
+        fprintf(stderr, "Error while allocation memory for the final audio: %s\n", strerror(errno));
+        exit(1);
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, writerthread, w) != 0) {
+        fprintf(stderr, "Error while starting the writer thread: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+// Waits for a free block to render the next window into
+static Frame *writer_acquire(Writer *w) {
+    pthread_mutex_lock(&w->lock);
+    while (w->head - w->tail == WRITER_BLOCKS) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    size_t b = w->head % WRITER_BLOCKS;
+    pthread_mutex_unlock(&w->lock);
+    return w->bufs + b * w->block_frames;
+}
+
+// Queues the first n frames of the block from the last writer_acquire(),
+// `silent` when they are all zeros
+static void writer_submit(Writer *w, size_t n, bool silent) {
+    pthread_mutex_lock(&w->lock);
+    w->counts[w->head % WRITER_BLOCKS] = n;
+    w->silent[w->head % WRITER_BLOCKS] = silent;
+    w->head++;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Writes whatever is still queued and stops the thread
+static void writer_finish(Writer *w) {
+    pthread_mutex_lock(&w->lock);
+    w->done = true;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    free(w->bufs);
+}
+
+// Adds src, the frames [a, b) of the voice, to dst
+static void mixspan(Frame *dst, const Frame *src, const Voice *v, size_t a, size_t b) {
+    size_t cut = v->cut < b ? v->cut : b;
+    if (a < cut) {
+        mix_add(dst, src, cut - a, v->gain);
+    }
+    if (v->cut < b) {
+        size_t f = a > v->cut ? a : v->cut;
+        mix_fade(dst + (f - a), src + (f - a), b - f, f - v->cut, v->fade, v->gain);
+    }
+}
+
+// Adds the frames [from, to) of the timeline that the voice covers to dst, which
+// starts at `from`. Pitched voices are interpolated a block at a time first.
+static void mixvoice(Frame *dst, const Voice *v, size_t from, size_t to) {
+    size_t a = from - v->pos, b = to - v->pos;
+    if (v->step == 1.0) {
+        mixspan(dst, v->frames + a, v, a, b);
+        return;
+    }
+    Frame block[BLOCK_FRAMES];
+    for (size_t off = a; off < b; off += BLOCK_FRAMES) {
+        size_t n = b - off < BLOCK_FRAMES ? b - off : BLOCK_FRAMES;
+        mix_pitch(block, v->frames, v->srccount / 2, off, n, v->step, renderopts.interp);
+        mixspan(dst + (off - a), block, v, off, off + n);
+    }
+}
+
+// The voice only covers the part of the event where the sample isn't silent. A
+// pitched sample interpolates between up to 2 frames on either side, so it keeps
+// its lead and gets 2 more frames after the last loud one.
+static void eventvoice(const RenderPlan *plan, size_t e, Voice *v) {
+    const Sample *s = &plan->samples[plan->events.sample[e]];
+    v->sample = plan->events.sample[e];
+    v->frames = s->frames;
+    v->srccount = s->count;
+    v->count = plan->events.length[e];
+    v->lead = 0;
+    v->pos = plan->events.start[e];
+    v->cut = plan->events.cut[e];
+    v->fade = plan->events.fade[e];
+    v->step = plan->events.step[e];
+    v->gain = plan->events.gain[e];
+    size_t active = s->active;
+    if (v->step == 1.0) {
+        v->lead = s->lead < v->count ? s->lead : v->count;
+    } else {
+        size_t frames = s->active / 2 + 2 < s->count / 2 ? s->active / 2 + 2 : s->count / 2;
+        active = frames > 0 ? ((size_t)((frames - 1) / v->step) + 1) * 2 : 0;
+    }
+    v->count = active < v->count ? active : v->count;
+}
+
+// Mixes all of a pattern occurrence into one buffer so the other occurrences
+// can be added to the output as a single span
+static void renderpattern(const RenderPlan *plan, PatternRender *r) {
+    const PlanPattern *pp = &plan->patterns.items[r->occurrence];
+    size_t count = 0, lead = SIZE_MAX;
+    for (size_t e = pp->first; e < pp->first + pp->count; ++e) {
+        Voice v;
+        eventvoice(plan, e, &v);
+        if (v.lead >= v.count) continue;
+        size_t start = v.pos - pp->start + v.lead, end = v.pos - pp->start + v.count;
+        lead = start < lead ? start : lead;
+        count = end > count ? end : count;
+    }
+    r->count = count;
+    r->lead = count > 0 ? lead : 0;
+    r->frames = calloc(count > 0 ? count : 1, sizeof(Frame));
+    stats_count(CT_ALLOCS, 1);
+    if (r->frames == NULL) {
+        fprintf(stderr, "Error while allocation memory for a pattern render: %s\n", strerror(errno));
+        exit(1);
+    }
+    for (size_t e = pp->first; e < pp->first + pp->count; ++e) {
+        Voice v;
+        eventvoice(plan, e, &v);
+        if (v.lead >= v.count) continue;
+        v.pos -= pp->start;
+        mixvoice(r->frames + v.pos + v.lead, &v, v.pos + v.lead, v.pos + v.count);
+    }
+}
+
+// Yields the voices of the plan in order. Positions never decrease, so the
+// renderer can stream through them. Patterns that repeat at the same tempo come
+// out as one voice holding their cached render.
+static bool nextvoice(RenderPlan *plan, PlanCursor *cur, Voice *v) {
+    while (cur->pi < plan->patterns.count) {
+        const PlanPattern *pp = &plan->patterns.items[cur->pi];
+        PatternRender *r = &plan->renders.items[pp->render];
+        if (cur->ei == 0 && pp->end <= cur->from) {
+            cur->pi++;
+            continue;
+        }
+        if (cur->ei == 0 && r->uses > 1 && !cur->split) {
+            if (r->frames == NULL) {
+                renderpattern(plan, r);
+            }
+            *v = (Voice){ .sample = SYM_NONE, .bus = pp->bus, .frames = r->frames, .srccount = r->count, .count = r->count, .lead = r->lead, .pos = pp->start, .cut = NO_CUT, .fade = VOICE_FADE_FRAMES, .step = 1.0, .gain = 1.0f };
+            stats_count(CT_INSTANCES, pp->count);
+            cur->pi++;
+            return true;
+        }
+        if (cur->ei < pp->count) {
+            size_t e = pp->first + cur->ei++;
+            if (plan->events.start[e] + plan->events.length[e] <= cur->from) continue;
+            eventvoice(plan, e, v);
+            v->bus = pp->bus;
+            stats_count(CT_INSTANCES, 1);
+            return true;
+        }
+        cur->ei = 0;
+        cur->pi++;
+    }
+    return false;
+}
+
+// The effect chains of one render. They keep their state from one tile to the
+// next, so the tiles have to go through them in order on a single thread.
+typedef struct {
+    FxChain *buses;
+    size_t nbuses;
+    FxChain master;
+} Mixer;
+
+static void mixer_init(Mixer *m, const RenderPlan *plan) {
+    m->nbuses = plan->nbuses;
+    m->buses = calloc(m->nbuses + 1, sizeof(FxChain));
+    if (m->buses == NULL) {
+        fprintf(stderr, "Error while allocation memory for the effects: %s\n", strerror(errno));
+        exit(1);
+    }
+    for (size_t k = 0; k < m->nbuses; ++k) {
+        fx_init(&m->buses[k], plan->buses[k].items, plan->buses[k].count, MIX_HEADROOM);
+    }
+    fx_init(&m->master, plan->masterfx.items, plan->masterfx.count, MIX_HEADROOM);
+}
+
+static void mixer_free(Mixer *m) {
+    for (size_t k = 0; k < m->nbuses; ++k) {
+        fx_free(&m->buses[k]);
+    }
+    fx_free(&m->master);
+    free(m->buses);
+}
+
+// Mixes every voice overlapping [start, start + n) into buf. Voices are added in
+// sequence order no matter how the timeline is split, which keeps the output of
+// parallel renders identical to the serial one. With `buses` (n floats for each
+// of the nbuses) the voices of a bus are mixed there instead, and the bus and
+// master stage is left to mixer_run(). Returns whether no voice reached the tile.
+static bool rendertile(Frame *buf, Frame *buses, size_t nbuses, size_t start, size_t n, const Voices *voices) {
+    uint64_t timer = stats_begin();
+    size_t end = start + n;
+    bool silent = true;
+    memset(buf, 0, n * sizeof(Frame));
+    if (buses != NULL) {
+        memset(buses, 0, nbuses * n * sizeof(Frame));
+    }
+    for (size_t vi = 0; vi < voices->count; ++vi) {
+        Voice v = voices->items[vi];
+        size_t vstart = v.pos + v.lead, vend = v.pos + v.count;
+        size_t from = vstart > start ? vstart : start;
+        size_t to = vend < end ? vend : end;
+        if (from < to) {
+            Frame *dst = buses != NULL && v.bus != SYM_NONE ? buses + v.bus * n : buf;
+            mixvoice(dst + (from - start), &v, from, to);
+            silent = false;
+        }
+    }
+    if (buses == NULL) {
+        if (silent) {
+            stats_count(CT_SILENT_BLOCKS, 1);
+        } else {
+            mix_master(buf, n, MIX_HEADROOM);
+        }
+    }
+    stats_end(PH_MIX, timer);
+    return silent;
+}
+
+// The rest of a tile that rendertile() mixed with buses: every bus goes through
+// its effects and is added to buf, then buf goes through the master effects.
+// Effects ring on, so the tile is never silent after this.
+static void mixer_run(Mixer *mx, Frame *buf, Frame *buses, size_t n) {
+    uint64_t timer = stats_begin();
+    for (size_t k = 0; k < mx->nbuses; ++k) {
+        fx_process(&mx->buses[k], buses + k * n, n);
+        mix_add(buf, buses + k * n, n, 1.0f);
+    }
+    fx_process(&mx->master, buf, n);
+    mix_master(buf, n, MIX_HEADROOM);
+    stats_end(PH_MIX, timer);
+}
+
+// Threads of one saveaudio() call, several songs can be rendered at once
+typedef struct {
+    pthread_barrier_t go;
+    pthread_barrier_t done;
+    const Voices *voices;
+    size_t nbuses;
+    bool quit;
+} TilePool;
+
+// `buses` is NULL when the song has no effects
+typedef struct {
+    pthread_t thread;
+    TilePool *pool;
+    Frame *buf;
+    Frame *buses;
+    size_t start;
+    size_t count;
+    bool silent;
+} Tile;
+
+static void *tileworker(void *arg) {
+    Tile *t = arg;
+    TilePool *pool = t->pool;
+    for (;;) {
+        pthread_barrier_wait(&pool->go);
+        if (pool->quit) break;
+        t->silent = t->count == 0 || rendertile(t->buf, t->buses, pool->nbuses, t->start, t->count, pool->voices);
+        pthread_barrier_wait(&pool->done);
+    }
+    return NULL;
+}
+
+// renderopts.from and renderopts.to clamped to the song, both on a frame boundary
+static void renderrange(const RenderPlan *plan, size_t *from, size_t *to) {
+    size_t total = plan->total_frames + plan->total_frames % 2;
+    *to = renderopts.to != 0 && renderopts.to < total ? renderopts.to - renderopts.to % 2 : total;
+    *from = renderopts.from < *to ? renderopts.from - renderopts.from % 2 : *to;
+}
+
+size_t saveaudio(RenderPlan *plan, const char *filepath) {
+    if (plan->patterns.count == 0) {
+        return 0;
+    }
+    Output out;
+    output_open(&out, filepath);
+
+    mix_init();
+
+    // The song is rendered in windows of `jobs` tiles and every window is queued
+    // for the writer thread as soon as it is mixed, so memory only depends on how
+    // many voices overlap. Worker i always renders tile i, tile 0 is done by this
+    // thread. Effects need the tiles in order: the workers only mix the voices,
+    // into a buffer per bus, and this thread runs the tiles through the effects.
+    // Every tile has its bus buffers, so the tiles are kept to a block then.
+    bool effects = planeffects(plan);
+    Mixer mixer, *mx = NULL;
+    if (effects) {
+        mixer_init(&mixer, plan);
+        mx = &mixer;
+    }
+    size_t jobs = renderopts.jobs > 0 ? renderopts.jobs : 1;
+    size_t tile_frames = jobs > 1 && !effects ? TILE_FRAMES : BLOCK_FRAMES;
+    Tile *tiles = calloc(jobs, sizeof(Tile));
+    Frame *buses = effects ? malloc((jobs * plan->nbuses + 1) * tile_frames * sizeof(Frame)) : NULL;
+    if (tiles == NULL || (effects && buses == NULL)) {
+        fprintf(stderr, "Error while allocation memory for the final audio: %s\n", strerror(errno));
+        exit(1);
+    }
+    for (size_t i = 0; i < jobs && effects; ++i) {
+        tiles[i].buses = buses + i * plan->nbuses * tile_frames;
+    }
+    Voices active = {0};
+    TilePool pool = { .voices = &active, .nbuses = plan->nbuses };
+    if (jobs > 1) {
+        pthread_barrier_init(&pool.go, NULL, jobs);
+        pthread_barrier_init(&pool.done, NULL, jobs);
+    }
+    Writer writer;
+    writer_start(&writer, &out, jobs * tile_frames);
+    for (size_t i = 1; i < jobs; ++i) {
+        tiles[i].pool = &pool;
+        if (pthread_create(&tiles[i].thread, NULL, tileworker, &tiles[i]) != 0) {
+            fprintf(stderr, "Error while starting a render thread: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    // With effects everything before `from` is mixed too, for their state, and
+    // thrown away. The window that ends at `from` is cut short so the written
+    // ones start right there.
+    size_t from, to;
+    renderrange(plan, &from, &to);
+    size_t begin = effects ? 0 : from;
+    PlanCursor cur = { .pi = planseek(plan, begin), .from = begin };
+    Voice next;
+    bool hasnext = nextvoice(plan, &cur, &next);
+    for (size_t start = begin, end; start < to; start = end) {
+        end = start + jobs * tile_frames;
+        end = start < from && end > from ? from : end;
+        while (hasnext && next.pos < end) {
+            DA_APPEND_COUNTED(&active, next);
+            hasnext = nextvoice(plan, &cur, &next);
+        }
+
+        // The plan knows the exact length, the tiles past it are cut short or skipped
+        size_t last = to < end ? to : end;
+        Frame *window = writer_acquire(&writer);
+        for (size_t i = 0; i < jobs; ++i) {
+            tiles[i].buf = window + i * tile_frames;
+            size_t tstart = start + i * tile_frames;
+            tiles[i].start = tstart;
+            tiles[i].count = tstart < last ? last - tstart : 0;
+            tiles[i].count = tiles[i].count < tile_frames ? tiles[i].count : tile_frames;
+        }
+        if (jobs > 1) pthread_barrier_wait(&pool.go);
+        tiles[0].silent = tiles[0].count == 0 || rendertile(tiles[0].buf, tiles[0].buses, plan->nbuses, tiles[0].start, tiles[0].count, &active);
+        if (jobs > 1) pthread_barrier_wait(&pool.done);
+        for (size_t i = 0; i < jobs && mx != NULL; ++i) {
+            if (tiles[i].count == 0) continue;
+            mixer_run(mx, tiles[i].buf, tiles[i].buses, tiles[i].count);
+            tiles[i].silent = false;
+        }
+
+        if (start >= from) {
+            bool silent = true;
+            for (size_t i = 0; i < jobs; ++i) {
+                silent = silent && tiles[i].silent;
+            }
+            writer_submit(&writer, last - start, silent);
+        }
+
+        size_t kept = 0;
+        for (size_t vi = 0; vi < active.count; ++vi) {
+            Voice v = active.items[vi];
+            if (v.pos + v.count > end) {
+                active.items[kept++] = v;
+            }
+        }
+        active.count = kept;
+    }
+
+    if (jobs > 1) {
+        pool.quit = true;
+        pthread_barrier_wait(&pool.go);
+        for (size_t i = 1; i < jobs; ++i) {
+            pthread_join(tiles[i].thread, NULL);
+        }
+        pthread_barrier_destroy(&pool.go);
+        pthread_barrier_destroy(&pool.done);
+    }
+    writer_finish(&writer);
+    free(active.items);
+    free(tiles);
+    free(buses);
+    if (mx != NULL) {
+        mixer_free(mx);
+    }
+
+    output_close(&out);
+
+    return to - from;
+}
+
+// out.wav -> out-kick.wav
+static char *stempath(const char *filepath, const char *name) {
+    const char *dot = strrchr(filepath, '.');
+    const char *slash = strrchr(filepath, '/');
+    size_t base = dot != NULL && (slash == NULL || dot > slash) ? (size_t)(dot - filepath) : strlen(filepath);
+    size_t len = strlen(filepath) + strlen(name) + 2;
+    char *path = malloc(len);
+    if (path == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    snprintf(path, len, "%.*s-%s%s", (int)base, filepath, name, filepath + base);
+    return path;
+}
+
+void savestems(RenderPlan *plan, const char *filepath) {
+    if (plan->patterns.count == 0) {
+        return;
+    }
+    if (!strcmp(filepath, "-")) {
+        fprintf(stderr, "Error: stems can't be written to stdout\n");
+        exit(1);
+    }
+    mix_init();
+
+    // stem[s] is the output of sample s, SYM_NONE when nothing plays it
+    size_t *stem = malloc((plan->nsamples + 1) * sizeof(size_t));
+    assert(stem != NULL);
+    for (size_t s = 0; s < plan->nsamples; ++s) stem[s] = SYM_NONE;
+    size_t nstems = 0;
+    for (size_t e = 0; e < plan->events.count; ++e) {
+        size_t s = plan->events.sample[e];
+        if (stem[s] == SYM_NONE) stem[s] = nstems++;
+    }
+    Output *outs = calloc(nstems + 1, sizeof(Output));
+    char **paths = calloc(nstems + 1, sizeof(char*));
+    Frame *bufs = malloc((nstems + 1) * BLOCK_FRAMES * sizeof(Frame));
+    if (outs == NULL || paths == NULL || bufs == NULL) {
+        fprintf(stderr, "Error while allocation memory for the final audio: %s\n", strerror(errno));
+        exit(1);
+    }
+    for (size_t s = 0; s < plan->nsamples; ++s) {
+        if (stem[s] == SYM_NONE) continue;
+        paths[stem[s]] = stempath(filepath, symname(plan->samples[s].name));
+        output_open(&outs[stem[s]], paths[stem[s]]);
+    }
+
+    // One walk over the plan for all the stems. Pattern renders mix several
+    // samples together, so every event is a voice of its own here.
+    size_t from, to;
+    renderrange(plan, &from, &to);
+    Voices active = {0};
+    PlanCursor cur = { .pi = planseek(plan, from), .split = true, .from = from };
+    Voice next;
+    bool hasnext = nextvoice(plan, &cur, &next);
+    for (size_t start = from; start < to; start += BLOCK_FRAMES) {
+        size_t end = start + BLOCK_FRAMES;
+        while (hasnext && next.pos < end) {
+            DA_APPEND_COUNTED(&active, next);
+            hasnext = nextvoice(plan, &cur, &next);
+        }
+        size_t n = to - start < BLOCK_FRAMES ? to - start : BLOCK_FRAMES;
+
+        uint64_t timer = stats_begin();
+        memset(bufs, 0, nstems * BLOCK_FRAMES * sizeof(Frame));
+        for (size_t vi = 0; vi < active.count; ++vi) {
+            Voice v = active.items[vi];
+            size_t vstart = v.pos + v.lead, vend = v.pos + v.count;
+            size_t sfrom = vstart > start ? vstart : start;
+            size_t sto = vend < start + n ? vend : start + n;
+            if (sfrom < sto) {
+                mixvoice(bufs + stem[v.sample] * BLOCK_FRAMES + (sfrom - start), &v, sfrom, sto);
+            }
+        }
+        for (size_t k = 0; k < nstems; ++k) {
+            mix_master(bufs + k * BLOCK_FRAMES, n, MIX_HEADROOM);
+        }
+        stats_end(PH_MIX, timer);
+        for (size_t k = 0; k < nstems; ++k) {
+            output_write(&outs[k], bufs + k * BLOCK_FRAMES, n, false);
+        }
+
+        size_t kept = 0;
+        for (size_t vi = 0; vi < active.count; ++vi) {
+            Voice v = active.items[vi];
+            if (v.pos + v.count > end) {
+                active.items[kept++] = v;
+            }
+        }
+        active.count = kept;
+    }
+
+    for (size_t k = 0; k < nstems; ++k) {
+        output_close(&outs[k]);
+        free(paths[k]);
+    }
+    free(active.items);
+    free(bufs);
+    free(paths);
+    free(outs);
+    free(stem);
+}
+
+void renderregion(RenderPlan *plan, Frame *buf, size_t start, size_t n) {
+    mix_init();
+    // Same as saveaudio(), effects need everything before the region mixed too
+    Mixer mixer, *mx = NULL;
+    Frame *buses = NULL;
+    size_t begin = start;
+    if (planeffects(plan)) {
+        mixer_init(&mixer, plan);
+        mx = &mixer;
+        begin = 0;
+        buses = malloc((plan->nbuses + 1) * BLOCK_FRAMES * sizeof(Frame));
+        if (buses == NULL) {
+            fprintf(stderr, "Error while allocation memory for the effects: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    // Voices come in and drop out as the blocks go, like in saveaudio(). The
+    // block that ends at `start` is cut short so the others line up with it.
+    Voices active = {0};
+    PlanCursor cur = { .pi = planseek(plan, begin), .from = begin };
+    Voice next;
+    bool hasnext = nextvoice(plan, &cur, &next);
+    Frame skipped[BLOCK_FRAMES];
+    size_t end = start + n;
+    for (size_t off = begin, to; off < end; off = to) {
+        to = off + BLOCK_FRAMES;
+        to = off < start && to > start ? start : to;
+        to = to < end ? to : end;
+        while (hasnext && next.pos < to) {
+            DA_APPEND_COUNTED(&active, next);
+            hasnext = nextvoice(plan, &cur, &next);
+        }
+        Frame *dst = off < start ? skipped : buf + (off - start);
+        rendertile(dst, buses, plan->nbuses, off, to - off, &active);
+        if (mx != NULL) {
+            mixer_run(mx, dst, buses, to - off);
+        }
+
+        size_t kept = 0;
+        for (size_t vi = 0; vi < active.count; ++vi) {
+            Voice v = active.items[vi];
+            if (v.pos + v.count > to) {
+                active.items[kept++] = v;
+            }
+        }
+        active.count = kept;
+    }
+    if (mx != NULL) {
+        mixer_free(mx);
+    }
+    free(buses);
+    free(active.items);
+}
+
+void writeaudio(const Frame *buf, size_t n, const char *filepath) {
+    Output out;
+    output_open(&out, filepath);
+    for (size_t off = 0; off < n; off += TILE_FRAMES) {
+        output_write(&out, buf + off, n - off < TILE_FRAMES ? n - off : TILE_FRAMES, false);
+    }
+    output_close(&out);
+}
@@ -0,0 +1,81 @@
+#ifndef RENDER_H_
+#define RENDER_H_
+
+#include <stdbool.h>
+
+#include "audio.h"
+#include "mix.h"
+
+typedef enum {
+    OUT_WAV,
+    OUT_S16LE,
+    OUT_F32LE,
+} OutputFormat;
+
+typedef struct {
+    size_t jobs;
+    OutputFormat format;
+    // Raw formats only: start the stream with a WAV header that has no length
+    bool wavheader;
+    // How pitched samples are played
+    Interp interp;
+    // Part of the timeline that saveaudio() and savestems() write, in floats.
+    // `to` of 0 is the end of the song.
+    size_t from;
+    size_t to;
+} RenderOptions;
+
+extern RenderOptions renderopts;
+
+// A sample instance (or a cached pattern render) placed on the output timeline,
+// fading out over `fade` frames from `cut` frames after `pos` when it isn't
+// NO_CUT. `frames` holds `srccount` floats that are played `step` times faster,
+// which gives `count`.
+// `sample` is SYM_NONE for a pattern render. `bus` is the effect bus of the
+// pattern it comes from, SYM_NONE if it goes straight to the master. The first
+// `lead` floats and everything after `count` are silent and never mixed.
+typedef struct {
+    size_t sample;
+    size_t bus;
+    const Frame *frames;
+    size_t srccount;
+    size_t count;
+    size_t lead;
+    size_t pos;
+    size_t cut;
+    size_t fade;
+    double step;
+    float gain;
+} Voice;
+DA(Voice)
+
+// Position of the renderer in the plan: pattern occurrence and event inside it.
+// With `split` every event comes out as its own voice, cached pattern renders
+// are never used. Voices that end before `from` are skipped.
+typedef struct {
+    size_t pi;
+    size_t ei;
+    bool split;
+    size_t from;
+} PlanCursor;
+
+// `filepath` can be "-" for stdout. Only renderopts.from to renderopts.to is
+// written and the render starts right there, whatever comes before it is never
+// mixed unless planeffects() needs it for the state of the effects. WAV files go through libsndfile, raw formats
+// and anything that isn't a regular file are streamed block by block as they are
+// rendered.
+size_t saveaudio(RenderPlan *plan, const char *filepath);
+
+// Same as saveaudio() but every sample gets a file of its own with only that
+// sample in it: out.wav becomes out-kick.wav, out-snare.wav, ... Mixed together
+// they give what saveaudio() writes, short of clipping. The effects of the
+// samples are in there, the ones of the pattern and master buses are not.
+void savestems(RenderPlan *plan, const char *filepath);
+
+// Renders [start, start + n) of the plan into buf, exactly the way saveaudio()
+// would have rendered those frames
+void renderregion(RenderPlan *plan, Frame *buf, size_t start, size_t n);
+// Writes an already rendered song the same way saveaudio() would
+void writeaudio(const Frame *buf, size_t n, const char *filepath);
+
+#endif
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "resample.h"
+#include "audio.h"
+#include "mix.h"
+#include "stats.h"
+
+// Filter bank for one rate ratio: branch p holds the taps for output positions
+// that fall p/up of the way between two input frames, in the order they are
+// applied to the input
+typedef struct {
+    size_t up;
+    size_t down;
+    size_t phases;
+    float *taps;
+} FilterBank;
+
+static struct {
+    FilterBank **items;
+    size_t count;
+    size_t capacity;
+} banks;
+static pthread_mutex_t bankslock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t gcd(size_t a, size_t b) {
+    while (b != 0) {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Zeroth order modified Bessel function, for the Kaiser window
+static double bessel0(double x) {
+    double sum = 1, term = 1;
+    for (int k = 1; k < 32; ++k) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static void makebank(FilterBank *b) {
+    const double beta = 8.0;
+    // Cut off below the lower of the two Nyquist frequencies, relative to the input rate
+    double cutoff = 0.5 * (b->up < b->down ? (double)b->up / b->down : 1.0) * 0.95;
+    b->taps = malloc(b->phases * RESAMPLE_TAPS * sizeof(float));
+    assert(b->taps != NULL);
+    stats_count(CT_ALLOCS, 1);
+    for (size_t p = 0; p < b->phases; ++p) {
+        double frac = (double)p / b->phases;
+        float *branch = b->taps + p * RESAMPLE_TAPS;
+        double sum = 0;
+        for (size_t j = 0; j < RESAMPLE_TAPS; ++j) {
+            // Distance in input frames from the output position to input frame j
+            double x = (double)j - (RESAMPLE_TAPS / 2 - 1) - frac;
+            double sinc = x == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x);
+            double w = x / (RESAMPLE_TAPS / 2);
+            double window = fabs(w) >= 1 ? 0 : bessel0(beta * sqrt(1 - w * w)) / bessel0(beta);
+            branch[j] = sinc * window;
+            sum += branch[j];
+        }
+        // Unity gain at DC for every branch
+        for (size_t j = 0; j < RESAMPLE_TAPS; ++j) {
+            branch[j] /= sum;
+        }
+    }
+}
+
+// Banks are built once per ratio and shared by every sample, samples are
+// decoded on several threads at once
+static const FilterBank *getbank(size_t up, size_t down) {
+    pthread_mutex_lock(&bankslock);
+    FilterBank *b = NULL;
+    for (size_t i = 0; i < banks.count && b == NULL; ++i) {
+        if (banks.items[i]->up == up && banks.items[i]->down == down) {
+            b = banks.items[i];
+        }
+    }
+    if (b == NULL) {
+        b = malloc(sizeof(FilterBank));
+        assert(b != NULL);
+        *b = (FilterBank){ .up = up, .down = down, .phases = up < RESAMPLE_MAX_PHASES ? up : RESAMPLE_MAX_PHASES };
+        makebank(b);
+        DA_APPEND(&banks, b);
+    }
+    pthread_mutex_unlock(&bankslock);
+    return b;
+}
+
+float *resample(const float *in, size_t frames, int channels, int rate, size_t *count) {
+    assert(channels > 0 && rate > 0);
+    size_t g = gcd(SAMPLE_RATE, rate);
+    size_t up = SAMPLE_RATE / g, down = rate / g;
+    size_t outframes = (frames * up + down - 1) / down;
+    *count = outframes * 2;
+    float *out = calloc(*count > 0 ? *count : 1, sizeof(float));
+    assert(out != NULL);
+    stats_count(CT_ALLOCS, 1);
+
+    // Each channel is filtered on its own, padded with silence on both sides so
+    // the taps never read out of bounds
+    size_t pad = RESAMPLE_TAPS;
+    float *planar = calloc(frames + 2 * pad, sizeof(float));
+    assert(planar != NULL);
+    const FilterBank *b = up == down ? NULL : getbank(up, down);
+    int outchannels = channels < 2 ? channels : 2;
+    for (int c = 0; c < outchannels; ++c) {
+        for (size_t i = 0; i < frames; ++i) {
+            planar[pad + i] = in[i * channels + c];
+        }
+        for (size_t n = 0; n < outframes; ++n) {
+            float v;
+            if (b == NULL) {
+                v = planar[pad + n];
+            } else {
+                // Output frame n sits at input position n * down / up
+                size_t t = n * down;
+                size_t base = t / up;
+                size_t phase = ((t % up) * b->phases + up / 2) / up;
+                if (phase == b->phases) {
+                    base++;
+                    phase = 0;
+                }
+                const float *x = planar + pad + base - (RESAMPLE_TAPS / 2 - 1);
+                v = mix_dot(b->taps + phase * RESAMPLE_TAPS, x, RESAMPLE_TAPS);
+            }
+            out[n * 2 + c] = v;
+            if (channels == 1) out[n * 2 + 1] = v;
+        }
+    }
+    free(planar);
+    return out;
+}
@@ -0,0 +1,16 @@
+#ifndef RESAMPLE_H_
+#define RESAMPLE_H_
+
+#include <stdlib.h>
+
+// Taps per polyphase branch
+#define RESAMPLE_TAPS 32
+// Rates that need more branches than this share the nearest one
+#define RESAMPLE_MAX_PHASES 4096
+
+// Converts `frames` interleaved frames of `channels` channels at `rate` to
+// interleaved stereo at SAMPLE_RATE. Mono is copied to both sides, anything
+// past the second channel is dropped. Returns a new buffer of *count floats.
+float *resample(const float *in, size_t frames, int channels, int rate, size_t *count);
+
+#endif
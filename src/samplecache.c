@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "samplecache.h"
+#include "audio.h"
+
+#define SAMPLECACHE_MAGIC "TRNGSMP"
+#define SAMPLECACHE_VERSION 2
+#define SAMPLECACHE_KEY_SZ (PATH_MAX + 128)
+// Frames start at this offset so they are suitably aligned for the mix kernels
+#define SAMPLECACHE_DATA_ALIGN 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t keylen;
+    uint64_t count;
+    uint64_t dataoffset;
+} SampleCacheHeader;
+
+// Every hit that is still mapped, so samplecache_unload() can find the mapping
+// its frames belong to
+typedef struct {
+    const float *frames;
+    void *map;
+    size_t size;
+} SampleCacheMap;
+
+static struct {
+    SampleCacheMap *items;
+    size_t count;
+    size_t capacity;
+} maps;
+static pthread_mutex_t mapslock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool cachedir(char dir[PATH_MAX]) {
+    const char *env = getenv("TRANG_CACHE_DIR");
+    int n;
+    if (env != NULL) {
+        if (*env == '\0') return false;
+        n = snprintf(dir, PATH_MAX, "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env != '\0') {
+        n = snprintf(dir, PATH_MAX, "%s/trang", env);
+    } else if ((env = getenv("HOME")) != NULL && *env != '\0') {
+        n = snprintf(dir, PATH_MAX, "%s/.cache/trang", env);
+    } else {
+        return false;
+    }
+    return n > 0 && n < PATH_MAX;
+}
+
+// The key describes everything the decoded frames depend on. A change to any of
+// it (the file was edited, the project rate changed) makes old entries unused.
+// The first `idlen` bytes name the source and the format, the rest is the
+// version of the file the frames were decoded from.
+static bool cachekey(const char *path, char key[SAMPLECACHE_KEY_SZ], size_t *keylen, size_t *idlen) {
+    char abspath[PATH_MAX];
+    struct stat st;
+    if (realpath(path, abspath) == NULL || stat(abspath, &st) != 0) {
+        return false;
+    }
+    int id = snprintf(key, SAMPLECACHE_KEY_SZ, "%s|%d|%d|%zu", abspath, SAMPLE_RATE, 2, sizeof(Frame));
+    if (id < 0 || id >= SAMPLECACHE_KEY_SZ) return false;
+    int n = snprintf(key + id, SAMPLECACHE_KEY_SZ - id, "|%lld|%lld.%09ld",
+                     (long long)st.st_size, (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+    if (n < 0 || n >= SAMPLECACHE_KEY_SZ - id) return false;
+    *keylen = id + n;
+    *idlen = id;
+    return true;
+}
+
+static uint64_t fnv1a(const char *s, size_t n) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Entries are named <id hash>-<key hash>.smp, so every version of one sample
+// shares a prefix and a store can find the ones it replaces
+static bool cachepath(const char *key, size_t keylen, size_t idlen, char out[PATH_MAX]) {
+    char dir[PATH_MAX];
+    if (!cachedir(dir)) return false;
+    int n = snprintf(out, PATH_MAX, "%s/%016llx-%016llx.smp", dir,
+                     (unsigned long long)fnv1a(key, idlen), (unsigned long long)fnv1a(key, keylen));
+    return n > 0 && n < PATH_MAX;
+}
+
+// Removes the entries of older versions of the sample `file` was stored for.
+// Only finished entries are touched, the temporaries of a concurrent store
+// don't end in .smp yet.
+static void evictstale(const char *dir, const char *file) {
+    const char *name = strrchr(file, '/') + 1;
+    size_t prefix = strchr(name, '-') + 1 - name;
+    DIR *d = opendir(dir);
+    if (d == NULL) return;
+    struct dirent *e;
+    char stale[PATH_MAX];
+    while ((e = readdir(d)) != NULL) {
+        size_t len = strlen(e->d_name);
+        if (strncmp(e->d_name, name, prefix) != 0 || !strcmp(e->d_name, name)
+         || len < 4 || strcmp(e->d_name + len - 4, ".smp") != 0) {
+            continue;
+        }
+        if (snprintf(stale, PATH_MAX, "%s/%s", dir, e->d_name) < PATH_MAX) {
+            unlink(stale);
+        }
+    }
+    closedir(d);
+}
+
+float *samplecache_load(const char *path, size_t *count) {
+    char key[SAMPLECACHE_KEY_SZ], file[PATH_MAX];
+    size_t keylen, idlen;
+    if (!cachekey(path, key, &keylen, &idlen) || !cachepath(key, keylen, idlen, file)) {
+        return NULL;
+    }
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SampleCacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const SampleCacheHeader *h = map;
+    const char *storedkey = (const char*)map + sizeof(SampleCacheHeader);
+    bool valid = !memcmp(h->magic, SAMPLECACHE_MAGIC, sizeof(h->magic))
+              && h->version == SAMPLECACHE_VERSION
+              && h->keylen == keylen
+              && sizeof(SampleCacheHeader) + keylen <= (size_t)st.st_size
+              && !memcmp(storedkey, key, keylen)
+              && h->dataoffset + h->count * sizeof(Frame) == (uint64_t)st.st_size;
+    if (!valid) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    *count = h->count;
+    SampleCacheMap m = { .frames = (float*)((char*)map + h->dataoffset), .map = map, .size = st.st_size };
+    pthread_mutex_lock(&mapslock);
+    DA_APPEND(&maps, m);
+    pthread_mutex_unlock(&mapslock);
+    return (float*)m.frames;
+}
+
+bool samplecache_unload(const float *frames) {
+    SampleCacheMap m = {0};
+    pthread_mutex_lock(&mapslock);
+    for (size_t i = 0; i < maps.count; ++i) {
+        if (maps.items[i].frames == frames) {
+            m = maps.items[i];
+            maps.items[i] = maps.items[--maps.count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mapslock);
+    if (m.map == NULL) return false;
+    munmap(m.map, m.size);
+    return true;
+}
+
+void samplecache_store(const char *path, const float *frames, size_t count) {
+    char key[SAMPLECACHE_KEY_SZ], file[PATH_MAX], dir[PATH_MAX], tmp[PATH_MAX];
+    size_t keylen, idlen;
+    if (!cachekey(path, key, &keylen, &idlen) || !cachepath(key, keylen, idlen, file) || !cachedir(dir)) {
+        return;
+    }
+    // mkdir -p
+    for (char *c = dir + 1; *c; ++c) {
+        if (*c == '/') {
+            *c = '\0';
+            mkdir(dir, 0755);
+            *c = '/';
+        }
+    }
+    mkdir(dir, 0755);
+
+    if (snprintf(tmp, PATH_MAX, "%s.XXXXXX", file) >= PATH_MAX) return;
+    int fd = mkstemp(tmp);
+    if (fd < 0) return;
+    FILE *f = fdopen(fd, "wb");
+    if (f == NULL) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+
+    SampleCacheHeader h = {
+        .magic = SAMPLECACHE_MAGIC,
+        .version = SAMPLECACHE_VERSION,
+        .keylen = keylen,
+        .count = count,
+    };
+    size_t headsz = sizeof(h) + keylen;
+    h.dataoffset = (headsz + SAMPLECACHE_DATA_ALIGN - 1) / SAMPLECACHE_DATA_ALIGN * SAMPLECACHE_DATA_ALIGN;
+    static const char pad[SAMPLECACHE_DATA_ALIGN] = {0};
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+           && fwrite(key, 1, keylen, f) == keylen
+           && fwrite(pad, 1, h.dataoffset - headsz, f) == h.dataoffset - headsz
+           && fwrite(frames, sizeof(Frame), count, f) == count;
+    ok = (fclose(f) == 0) && ok;
+    // rename() makes the entry appear all at once, a concurrent run never sees half of it
+    if (!ok || rename(tmp, file) != 0) {
+        unlink(tmp);
+        return;
+    }
+    evictstale(dir, file);
+}
@@ -0,0 +1,23 @@
+#ifndef SAMPLECACHE_H_
+#define SAMPLECACHE_H_
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Decoded samples are kept on disk as raw float frames, keyed by the source path,
+// its size and mtime and the format they were converted to. A hit is mmapped
+// read-only and used in place. Storing a sample removes the entries of its
+// older versions, so editing a file doesn't leave the stale frames behind.
+//
+// The cache lives in $TRANG_CACHE_DIR, $XDG_CACHE_HOME/trang or ~/.cache/trang.
+// Setting TRANG_CACHE_DIR to an empty string turns it off.
+
+// Returns the cached frames of `path` or NULL if there are none (or they are stale)
+float *samplecache_load(const char *path, size_t *count);
+// Unmaps frames that samplecache_load() returned. Returns false for any other
+// pointer, which is left alone.
+bool samplecache_unload(const float *frames);
+// Failing to store is not an error, the sample just gets decoded again next time
+void samplecache_store(const char *path, const float *frames, size_t count);
+
+#endif
@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "stats.h"
+
+typedef struct {
+    Phase phase;
+    long tid;
+    uint64_t start;
+    uint64_t duration;
+} Span;
+
+bool stats_enabled = false;
+uint64_t stats_counters[CT_COUNT];
+
+static bool tracing = false;
+static uint64_t epoch;
+static uint64_t phasetime[PH_COUNT];
+static uint64_t phasecalls[PH_COUNT];
+static struct {
+    Span *items;
+    size_t count;
+    size_t capacity;
+} spans;
+static pthread_mutex_t spanslock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *phasenames[PH_COUNT] = {
+    [PH_LEX] = "lex",
+    [PH_PARSE] = "parse",
+    [PH_DECODE] = "decode",
+    [PH_PLAN] = "plan",
+    [PH_MIX] = "mix",
+    [PH_WRITE] = "write",
+};
+
+static const char *counternames[CT_COUNT] = {
+    [CT_TOKENS] = "tokens",
+    [CT_ALLOCS] = "allocations",
+    [CT_INSTANCES] = "sample instances mixed",
+    [CT_FRAMES_WRITTEN] = "frames written",
+    [CT_BYTES_DECODED] = "bytes decoded",
+    [CT_CUTS] = "voices cut",
+    [CT_SILENT_BLOCKS] = "silent blocks",
+};
+
+static uint64_t nowns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_enable(bool trace) {
+    stats_enabled = true;
+    tracing = tracing || trace;
+    if (epoch == 0) epoch = nowns();
+}
+
+uint64_t stats_begin(void) {
+    return stats_enabled ? nowns() : 0;
+}
+
+void stats_end(Phase p, uint64_t start) {
+    if (!stats_enabled || start == 0) return;
+    uint64_t end = nowns();
+    __atomic_fetch_add(&phasetime[p], end - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&phasecalls[p], 1, __ATOMIC_RELAXED);
+    if (!tracing) return;
+
+    Span s = { .phase = p, .tid = syscall(SYS_gettid), .start = start - epoch, .duration = end - start };
+    pthread_mutex_lock(&spanslock);
+    if (spans.count >= spans.capacity) {
+        spans.capacity = spans.capacity ? spans.capacity * 2 : 1024;
+        spans.items = realloc(spans.items, spans.capacity * sizeof(Span));
+        if (spans.items == NULL) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+        }
+    }
+    spans.items[spans.count++] = s;
+    pthread_mutex_unlock(&spanslock);
+}
+
+void stats_print(FILE *f) {
+    if (!stats_enabled) return;
+    fprintf(f, "Total: %.3f ms\n", (nowns() - epoch) / 1e6);
+    fprintf(f, "Phase          time (ms)     calls\n");
+    for (int p = 0; p < PH_COUNT; ++p) {
+        fprintf(f, "%-10s %13.3f %9llu\n", phasenames[p], phasetime[p] / 1e6, (unsigned long long)phasecalls[p]);
+    }
+    fprintf(f, "(lex is an extra pass over the scripts, decode and mix add up the time of every thread)\n");
+    for (int c = 0; c < CT_COUNT; ++c) {
+        fprintf(f, "%-24s %llu\n", counternames[c], (unsigned long long)stats_counters[c]);
+    }
+}
+
+void stats_writetrace(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error while opening the file %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    long pid = getpid();
+    fprintf(f, "{\"traceEvents\": [\n");
+    for (size_t i = 0; i < spans.count; ++i) {
+        Span s = spans.items[i];
+        fprintf(f, "  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": %ld, \"tid\": %ld, \"ts\": %.3f, \"dur\": %.3f}%s\n",
+                phasenames[s.phase], pid, s.tid, s.start / 1e3, s.duration / 1e3, i + 1 < spans.count ? "," : "");
+    }
+    fprintf(f, "], \"displayTimeUnit\": \"ms\"}\n");
+    fclose(f);
+}
@@ -0,0 +1,56 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Timers and counters for --stats and --trace. Everything is a no-op until
+// stats_enable() is called, so the hooks can stay in the hot paths.
+
+typedef enum {
+    PH_LEX,
+    PH_PARSE,
+    PH_DECODE,
+    PH_PLAN,
+    PH_MIX,
+    PH_WRITE,
+    PH_COUNT,
+} Phase;
+
+typedef enum {
+    CT_TOKENS,
+    CT_ALLOCS,
+    CT_INSTANCES,
+    CT_FRAMES_WRITTEN,
+    CT_BYTES_DECODED,
+    CT_CUTS,
+    CT_SILENT_BLOCKS,
+    CT_COUNT,
+} Counter;
+
+extern bool stats_enabled;
+
+// `trace` also keeps every timed span so stats_writetrace() can dump them
+void stats_enable(bool trace);
+
+static inline void stats_count(Counter c, uint64_t n) {
+    extern uint64_t stats_counters[CT_COUNT];
+    if (stats_enabled) __atomic_fetch_add(&stats_counters[c], n, __ATOMIC_RELAXED);
+}
+
+// DA_APPEND (from util.h) that counts the array growing as an allocation
+#define DA_APPEND_COUNTED(da, item) do {\
+    if ((da)->count >= (da)->capacity) stats_count(CT_ALLOCS, 1);\
+    DA_APPEND(da, item);\
+} while (0)
+
+// Returns the start time to pass to stats_end(), 0 when stats are off
+uint64_t stats_begin(void);
+void stats_end(Phase p, uint64_t start);
+
+void stats_print(FILE *f);
+// Chrome trace event format, open it in chrome://tracing or Perfetto
+void stats_writetrace(const char *path);
+
+#endif
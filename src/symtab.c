@@ -0,0 +1,90 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "symtab.h"
+#include "lexer.h"
+
+#define SYMTAB_INIT_CAP 256
+
+static Symbols symbols;
+
+// Open addressing with linear probing. A slot holds id + 1, 0 means empty.
+static struct {
+    size_t *slots;
+    size_t capacity;
+} table;
+
+static uint64_t hashname(const char *name, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static size_t *findslot(const char *name, size_t len) {
+    size_t mask = table.capacity - 1;
+    size_t i = hashname(name, len) & mask;
+    while (table.slots[i] != 0) {
+        const char *sym = symbols.items[table.slots[i] - 1].name;
+        if (!strncmp(sym, name, len) && sym[len] == '\0') break;
+        i = (i + 1) & mask;
+    }
+    return &table.slots[i];
+}
+
+static void grow(void) {
+    size_t *old = table.slots;
+    size_t oldcap = table.capacity;
+    table.capacity = oldcap ? oldcap * 2 : SYMTAB_INIT_CAP;
+    table.slots = calloc(table.capacity, sizeof(size_t));
+    assert(table.slots != NULL);
+    for (size_t i = 0; i < oldcap; ++i) {
+        if (old[i] != 0) {
+            const char *name = symbols.items[old[i] - 1].name;
+            *findslot(name, strlen(name)) = old[i];
+        }
+    }
+    free(old);
+}
+
+size_t intern(const char *name) {
+    return intern_n(name, strlen(name));
+}
+
+size_t intern_n(const char *name, size_t len) {
+    if (len >= SYM_NAME_SZ || memchr(name, '\0', len) != NULL) {
+        fprintf(stderr, "Error: invalid name: %.*s\n", (int)len, name);
+        lex_fail();
+    }
+    if ((symbols.count + 1) * 2 > table.capacity) {
+        grow();
+    }
+    size_t *slot = findslot(name, len);
+    if (*slot == 0) {
+        Symbol sym = { .sample = SYM_NONE, .pattern = SYM_NONE };
+        memcpy(sym.name, name, len);
+        DA_APPEND(&symbols, sym);
+        *slot = symbols.count;
+    }
+    return *slot - 1;
+}
+
+Symbol *symbol(size_t id) {
+    assert(id < symbols.count);
+    return &symbols.items[id];
+}
+
+const char *symname(size_t id) {
+    return symbol(id)->name;
+}
+
+void sym_reset(void) {
+    symbols.count = 0;
+    if (table.slots != NULL) {
+        memset(table.slots, 0, table.capacity * sizeof(size_t));
+    }
+}
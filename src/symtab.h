@@ -0,0 +1,28 @@
+#ifndef SYMTAB_H_
+#define SYMTAB_H_
+
+#include <stdlib.h>
+
+#include "util.h"
+
+#define SYM_NAME_SZ 64
+#define SYM_NONE ((size_t)-1)
+
+// Every identifier in a script is interned once and from then on referred to by
+// its id. Ids are stable and index straight into the symbols array.
+typedef struct {
+    char name[SYM_NAME_SZ];
+    size_t sample;
+    size_t pattern;
+} Symbol;
+DA(Symbol)
+
+size_t intern(const char *name);
+// Same as intern() for a name that isn't NUL terminated
+size_t intern_n(const char *name, size_t len);
+Symbol *symbol(size_t id);
+const char *symname(size_t id);
+// Drops every symbol, the ids handed out before are no longer valid
+void sym_reset(void);
+
+#endif
@@ -17,6 +17,18 @@
     (da)->items[(da)->count++] = item;\
 } while (0)
 
+// Same as DA_APPEND but the items live in `arena` and go away with it
+#define DA_APPEND_ARENA(arena, da, item) do {\
+    if ((da)->count >= (da)->capacity) {\
+        size_t oldcap = (da)->capacity;\
+        (da)->capacity = oldcap == 0 ? DA_INIT_CAP : oldcap * 2;\
+        (da)->items = arena_realloc((arena), (da)->items,\
+                                    oldcap * sizeof(*(da)->items),\
+                                    (da)->capacity * sizeof(*(da)->items));\
+    }\
+    (da)->items[(da)->count++] = item;\
+} while (0)
+
 #define DA(type) \
 typedef struct {\
     type *items;\
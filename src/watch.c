@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+#include "parser.h"
+#include "audio.h"
+#include "render.h"
+
+// Changes usually come in bursts (editors write, rename and chmod), wait this
+// long for the burst to end before re-rendering
+#define WATCH_SETTLE_MS 100
+
+typedef struct {
+    int wd;
+    char name[NAME_MAX + 1];
+} WatchedFile;
+DA(WatchedFile)
+
+// Half-open range of output frames that has to be mixed again
+typedef struct {
+    size_t from;
+    size_t to;
+} Region;
+DA(Region)
+
+typedef struct {
+    RenderPlan plan;
+    Frame *buf;
+    size_t count;
+    uint64_t *sigs;
+} Render;
+
+static uint64_t hashmix(uint64_t h, uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+        h ^= (v >> (i * 8)) & 0xFF;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Identifies what an occurrence plays relative to its own start, the effects of
+// its bus included. Samples are compared by their frames, a sample file that
+// changed gets decoded into new ones.
+static uint64_t occurrencesig(const RenderPlan *plan, const PlanPattern *pp) {
+    uint64_t h = 14695981039346656037ULL;
+    h = hashmix(h, plan->renders.items[pp->render].uses > 1);
+    for (size_t e = pp->first; e < pp->first + pp->count; ++e) {
+        h = hashmix(h, plan->events.start[e] - pp->start);
+        h = hashmix(h, (uintptr_t)plan->samples[plan->events.sample[e]].frames);
+        h = hashmix(h, plan->events.length[e]);
+        h = hashmix(h, plan->events.cut[e]);
+        h = hashmix(h, plan->events.fade[e]);
+        union { double d; uint64_t u; } step = { .d = plan->events.step[e] };
+        union { float f; uint32_t u; } gain = { .f = plan->events.gain[e] };
+        h = hashmix(h, step.u);
+        h = hashmix(h, gain.u);
+    }
+    if (pp->bus != SYM_NONE) {
+        const Effects *bus = &plan->buses[pp->bus];
+        h = hashmix(h, fx_signature(bus->items, bus->count));
+    }
+    return h;
+}
+
+static size_t occurrenceend(const RenderPlan *plan, const PlanPattern *pp) {
+    size_t end = pp->start;
+    for (size_t e = pp->first; e < pp->first + pp->count; ++e) {
+        size_t eend = plan->events.start[e] + plan->events.length[e];
+        end = eend > end ? eend : end;
+    }
+    return end;
+}
+
+// Pattern renders of the old plan that are still valid move over to the new one
+static void adoptrenders(RenderPlan *plan, RenderPlan *old) {
+    for (size_t i = 0; i < plan->renders.count; ++i) {
+        PatternRender *r = &plan->renders.items[i];
+        if (r->uses < 2) continue;
+        uint64_t sig = occurrencesig(plan, &plan->patterns.items[r->occurrence]);
+        for (size_t j = 0; j < old->renders.count; ++j) {
+            PatternRender *o = &old->renders.items[j];
+            if (o->frames != NULL && occurrencesig(old, &old->patterns.items[o->occurrence]) == sig) {
+                r->frames = o->frames;
+                r->count = o->count;
+                r->lead = o->lead;
+                o->frames = NULL;
+                break;
+            }
+        }
+    }
+}
+
+static int cmpregion(const void *a, const void *b) {
+    const Region *ra = a, *rb = b;
+    return ra->from < rb->from ? -1 : ra->from > rb->from;
+}
+
+// Frames of the new render that may differ from the old one: everything covered
+// by an occurrence that moved or changed, in either version, plus any growth
+static void diff(const Render *old, const Render *new, Regions *regions) {
+    size_t n = new->plan.patterns.count > old->plan.patterns.count ? new->plan.patterns.count : old->plan.patterns.count;
+    for (size_t i = 0; i < n; ++i) {
+        const PlanPattern *op = i < old->plan.patterns.count ? &old->plan.patterns.items[i] : NULL;
+        const PlanPattern *np = i < new->plan.patterns.count ? &new->plan.patterns.items[i] : NULL;
+        if (op && np && op->start == np->start && old->sigs[i] == new->sigs[i]) {
+            continue;
+        }
+        if (op) {
+            Region r = { op->start, occurrenceend(&old->plan, op) };
+            DA_APPEND(regions, r);
+        }
+        if (np) {
+            Region r = { np->start, occurrenceend(&new->plan, np) };
+            DA_APPEND(regions, r);
+        }
+    }
+    if (new->count > old->count) {
+        Region r = { old->count, new->count };
+        DA_APPEND(regions, r);
+    }
+    const Effects *newfx = &new->plan.masterfx, *oldfx = &old->plan.masterfx;
+    if (fx_signature(newfx->items, newfx->count) != fx_signature(oldfx->items, oldfx->count)) {
+        Region r = { 0, new->count };
+        DA_APPEND(regions, r);
+    }
+    if (regions->count == 0) return;
+
+    qsort(regions->items, regions->count, sizeof(Region), cmpregion);
+    size_t merged = 0;
+    for (size_t i = 0; i < regions->count; ++i) {
+        Region r = regions->items[i];
+        r.to = r.to < new->count ? r.to : new->count;
+        if (r.from >= r.to) continue;
+        if (merged > 0 && r.from <= regions->items[merged - 1].to) {
+            Region *last = &regions->items[merged - 1];
+            last->to = r.to > last->to ? r.to : last->to;
+        } else {
+            regions->items[merged++] = r;
+        }
+    }
+    regions->count = merged;
+    // Effects carry their state along, a change reaches everything after it
+    if (merged > 0 && (planeffects(&new->plan) || planeffects(&old->plan))) {
+        regions->items[0].to = new->count;
+        regions->count = 1;
+    }
+}
+
+// Returns false when the script has an error, which a script that is being
+// edited has all the time, or when a sample can't be decoded because it is
+// saved while the script gets loaded. Nothing is built then.
+static bool load(const char *filepath, Render *r) {
+    resetproject();
+    if (!parse(filepath) || !loadsamples()) {
+        return false;
+    }
+    buildplan(&r->plan);
+    r->count = r->plan.total_frames + r->plan.total_frames % 2;
+    r->sigs = malloc((r->plan.patterns.count + 1) * sizeof(uint64_t));
+    assert(r->sigs != NULL);
+    for (size_t i = 0; i < r->plan.patterns.count; ++i) {
+        r->sigs[i] = occurrencesig(&r->plan, &r->plan.patterns.items[i]);
+    }
+    return true;
+}
+
+static void addwatch(int fd, WatchedFiles *files, const char *path) {
+    char dir[PATH_MAX], base[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    snprintf(base, sizeof(base), "%s", path);
+    // Watching the directory instead of the file itself also catches editors
+    // that save by writing a new file and renaming it over the old one
+    int wd = inotify_add_watch(fd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ATTRIB);
+    if (wd < 0) {
+        fprintf(stderr, "Warning: can't watch %s: %s\n", path, strerror(errno));
+        return;
+    }
+    WatchedFile f = { .wd = wd };
+    snprintf(f.name, sizeof(f.name), "%s", basename(base));
+    DA_APPEND(files, f);
+}
+
+static void setwatches(int fd, WatchedFiles *files, const char *filepath, const RenderPlan *plan) {
+    for (size_t i = 0; i < files->count; ++i) {
+        inotify_rm_watch(fd, files->items[i].wd);
+    }
+    files->count = 0;
+    addwatch(fd, files, filepath);
+    for (size_t i = 0; i < plan->nsamples; ++i) {
+        if (plan->samples[i].frames != NULL) {
+            addwatch(fd, files, plan->samples[i].path);
+        }
+    }
+}
+
+// Blocks until one of the watched files changes
+static void waitchange(int fd, const WatchedFiles *files) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    int timeout = -1;
+    for (;;) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) {
+            fprintf(stderr, "Error while waiting for changes: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (ready == 0) return;
+        ssize_t len = read(fd, events, sizeof(events));
+        if (len < 0 && errno == EINTR) continue;
+        if (len < 0) {
+            fprintf(stderr, "Error while waiting for changes: %s\n", strerror(errno));
+            exit(1);
+        }
+        for (char *p = events; p < events + len;) {
+            struct inotify_event *ev = (struct inotify_event*)p;
+            for (size_t i = 0; i < files->count && !changed; ++i) {
+                changed = ev->len > 0 && files->items[i].wd == ev->wd && !strcmp(files->items[i].name, ev->name);
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        if (changed) timeout = WATCH_SETTLE_MS;
+    }
+}
+
+void watch(const char *filepath, const char *output) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Error while starting to watch %s: %s\n", filepath, strerror(errno));
+        exit(1);
+    }
+    WatchedFiles files = {0};
+
+    Render cur = {0};
+    if (!load(filepath, &cur)) {
+        exit(1);
+    }
+    cur.buf = malloc((cur.count + 1) * sizeof(Frame));
+    assert(cur.buf != NULL);
+    renderregion(&cur.plan, cur.buf, 0, cur.count);
+    writeaudio(cur.buf, cur.count, output);
+    fprintf(stderr, "Rendered %s (%zu frames), watching for changes\n", output, cur.count);
+
+    bool loaded = true;
+    for (;;) {
+        setwatches(fd, &files, filepath, &cur.plan);
+        // A sample that failed may be new to the script, it has to be watched
+        // for the fix to come in
+        const Samples *samples = projectsamples();
+        for (size_t i = 0; i < samples->count && !loaded; ++i) {
+            addwatch(fd, &files, samples->items[i].path);
+        }
+        waitchange(fd, &files);
+
+        Render next = {0};
+        loaded = load(filepath, &next);
+        if (!loaded) {
+            fprintf(stderr, "Keeping the last render of %s until the next change\n", output);
+            continue;
+        }
+        adoptrenders(&next.plan, &cur.plan);
+        next.buf = malloc((next.count + 1) * sizeof(Frame));
+        assert(next.buf != NULL);
+        memcpy(next.buf, cur.buf, (next.count < cur.count ? next.count : cur.count) * sizeof(Frame));
+
+        Regions regions = {0};
+        diff(&cur, &next, &regions);
+        size_t remixed = 0;
+        for (size_t i = 0; i < regions.count; ++i) {
+            Region r = regions.items[i];
+            renderregion(&next.plan, next.buf + r.from, r.from, r.to - r.from);
+            remixed += r.to - r.from;
+        }
+        free(regions.items);
+        writeaudio(next.buf, next.count, output);
+        fprintf(stderr, "Rendered %s (re-mixed %zu of %zu frames)\n", output, remixed, next.count);
+
+        freeplan(&cur.plan);
+        free(cur.buf);
+        free(cur.sigs);
+        cur = next;
+    }
+}
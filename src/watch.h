@@ -0,0 +1,9 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+// Renders the script, then re-renders it every time the script or one of its
+// samples changes on disk. Only the parts of the output covered by patterns
+// or samples that actually changed are mixed again. Never returns.
+void watch(const char *filepath, const char *output);
+
+#endif